@@ -51,6 +51,12 @@
  */
 #define FIFO_EVT_OVERRUN	(1 << 4)
 
+/*!
+ * Low-water event.  Indicates that a read has brought the buffer level
+ * down to the low-water mark, and the producer should refill it.
+ */
+#define FIFO_EVT_LOW		(1 << 5)
+
 /*!
  * FIFO Buffer interface.
  */
@@ -66,6 +72,7 @@ struct fifo_t {
 	volatile uint8_t stored_sz;	/*!< Buffer usage size */
 	volatile uint8_t read_ptr;	/*!< Read pointer location */
 	volatile uint8_t write_ptr;	/*!< Write pointer location */
+	uint8_t low_mark;		/*!< Low-water mark */
 
 	uint8_t producer_evtm;		/*!< Producer event mask */
 	uint8_t consumer_evtm;		/*!< Consumer event mask */
@@ -94,13 +101,15 @@ static void fifo_empty(struct fifo_t* const fifo) {
 }
 
 /*!
- * Initialise the buffer
+ * Initialise the buffer.  The low-water mark starts at zero; set
+ * low_mark afterwards to be notified earlier.
  */
 static void fifo_init(struct fifo_t* const fifo,
 		volatile uint8_t* buffer, uint8_t sz) {
 	fifo_empty(fifo);
 	fifo->buffer = buffer;
 	fifo->total_sz = sz;
+	fifo->low_mark = 0;
 }
 
 /*!
@@ -116,6 +125,8 @@ static int16_t fifo_read_one(struct fifo_t* const fifo) {
 	uint8_t byte = fifo->buffer[fifo->read_ptr];
 	fifo->stored_sz--;
 	fifo->read_ptr = (fifo->read_ptr + 1) % fifo->total_sz;
+	if (fifo->stored_sz == fifo->low_mark)
+		fifo_exec(fifo, FIFO_EVT_LOW);
 	if (!fifo->stored_sz)
 		fifo_exec(fifo, FIFO_EVT_EMPTY);
 	return byte;
@@ -205,4 +216,40 @@ static uint8_t fifo_write(struct fifo_t* const fifo,
 	return count;
 }
 
+/*!
+ * Return the number of bytes that may be written contiguously from the
+ * write pointer, for producers that generate data in place at
+ * fifo_write_buf().  Follow up with fifo_commit().
+ */
+static uint8_t fifo_write_contig(const struct fifo_t* const fifo) {
+	uint8_t space = fifo->total_sz - fifo->stored_sz;
+	uint8_t contig = fifo->total_sz - fifo->write_ptr;
+	return (space < contig) ? space : contig;
+}
+
+/*!
+ * Return the location of the write pointer.
+ */
+static uint8_t* fifo_write_buf(const struct fifo_t* const fifo) {
+	return (uint8_t*)(fifo->buffer + fifo->write_ptr);
+}
+
+/*!
+ * Mark bytes written in place at the write pointer as stored.  sz must
+ * not exceed fifo_write_contig().  If the consumer runs from an
+ * interrupt, call this with interrupts disabled, as the update of the
+ * buffer level is not atomic.
+ */
+static void fifo_commit(struct fifo_t* const fifo, uint8_t sz) {
+	if (!sz)
+		return;
+
+	fifo->stored_sz += sz;
+	fifo->write_ptr = (fifo->write_ptr + sz) % fifo->total_sz;
+	fifo_exec(fifo, FIFO_EVT_NEW);
+
+	if (fifo->stored_sz == fifo->total_sz)
+		fifo_exec(fifo, FIFO_EVT_FULL);
+}
+
 #endif
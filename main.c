@@ -20,14 +20,148 @@
 
 #include "poly.h"
 #include "fifo.h"
+#include <stddef.h>
 #include <avr/io.h>
 #include <util/delay.h>
+#include <util/atomic.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
 
 #define SAMPLE_LEN	16
 static volatile uint8_t sample_buffer[SAMPLE_LEN];
 static struct fifo_t sample_fifo;
 
+/*! FIFO level at which the ISR asks for a refill */
+#define SAMPLE_MARK	(SAMPLE_LEN/2)
+/*! FIFO level below which we shed load */
+#define SAMPLE_LOW	(SAMPLE_LEN/4)
+/*! FIFO level at or above which we have headroom */
+#define SAMPLE_HIGH	(SAMPLE_MARK)
+/*! Refills with headroom before restoring a priority level */
+#define SHED_RESTORE	(1024)
+static uint16_t shed_headroom;
+
+/*!
+ * Adjust the load shedding threshold according to the FIFO level at the
+ * start of a refill.  A refill started promptly finds the FIFO at the
+ * low-water mark.  We shed a priority level as soon as the FIFO runs
+ * lower than that, and restore one after a sustained period of
+ * headroom.
+ */
+static void shed_load(uint8_t level) {
+	if (level < SAMPLE_LOW) {
+		if (poly_shed)
+			poly_shed--;
+		shed_headroom = 0;
+	} else if (level < SAMPLE_HIGH) {
+		shed_headroom = 0;
+	} else if (poly_shed < POLY_PRIO_LOWEST) {
+		shed_headroom++;
+		if (shed_headroom >= SHED_RESTORE) {
+			poly_shed++;
+			shed_headroom = 0;
+		}
+	}
+}
+
+/*!
+ * PWM output: unsigned 8-bit samples.
+ */
+static struct poly_out_t pwm_out = {
+	.format = POLY_OUT_U8,
+	.shift = -9,
+	.channels = 1,
+};
+
+/*!
+ * Set by the ISR when the FIFO needs refilling.
+ */
+static volatile uint8_t sample_refill;
+
+/*!
+ * Cooperative task hook.  Firmware that does other work alongside the
+ * synthesizer defines this; it is called from the main loop whenever
+ * the FIFO does not need refilling, and must return promptly.
+ */
+extern void synth_task(void) __attribute__((weak));
+
+/*!
+ * Ask for a refill when the FIFO reaches the low-water mark, or runs
+ * dry.  Called from the ISR.
+ */
+static void sample_refill_evth(struct fifo_t* const fifo,
+		uint8_t events) {
+	(void)fifo;
+	(void)events;
+	sample_refill = 1;
+}
+
+/*!
+ * Run the task hook and sleep until a refill is needed.  Interrupts
+ * are disabled between checking the flag and sleeping, so a request
+ * arriving in between wakes us straight away: the instruction after
+ * sei always executes before any interrupt is taken.
+ */
+static void sample_wait(void) {
+	PORTB &= ~(1 << 3);
+	while (1) {
+		if (synth_task)
+			synth_task();
+		cli();
+		if (sample_refill)
+			break;
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+	sample_refill = 0;
+	sei();
+	PORTB |= (1 << 3);
+}
+
+/*!
+ * Render a batch of samples, filling the FIFO.  The FIFO level is
+ * shared with the ISR, so it is updated atomically; rendering happens
+ * in free space the ISR does not touch.
+ */
+static void sample_render(void) {
+	uint8_t sz;
+	while (poly_remain && (sz = fifo_write_contig(&sample_fifo))) {
+		sz = poly_render(fifo_write_buf(&sample_fifo), sz, &pwm_out);
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+			fifo_commit(&sample_fifo, sz);
+		}
+	}
+
+	/* Segment ended short of the mark; come straight back */
+	if (sample_fifo.stored_sz <= SAMPLE_MARK)
+		sample_refill = 1;
+}
+
+#if defined(_POLY_STATS) || defined(_POLY_TRACE)
+/*!
+ * Count and trace output FIFO underruns and overruns.
+ */
+static void sample_fifo_evth(struct fifo_t* const fifo, uint8_t events) {
+	POLY_TRACE(POLY_TRACE_FIFO, events, fifo->stored_sz);
+	if (events & FIFO_EVT_UNDERRUN)
+		POLY_STATS_INC(underrun);
+	if (events & FIFO_EVT_OVERRUN)
+		POLY_STATS_INC(overrun);
+}
+#endif
+
+/*!
+ * Initial synthesizer configuration.
+ */
+static const struct poly_evt_t synth_config[] = {
+	{ .flags = POLY_EVT_TYPE_ENABLE,	.value = 1 },
+	{ .flags = POLY_EVT_TYPE_IFREQ,		.value = 1000 },
+	{ .flags = POLY_EVT_TYPE_IAMP,		.value = 255 },
+	{ .flags = POLY_EVT_TYPE_ASCALE,	.value = 8 },
+};
+
 int main(void) {
 	struct poly_evt_t poly_evt;
 
@@ -40,6 +174,16 @@ int main(void) {
 	PLLCSR |= (1<<PCKE);
 
 	fifo_init(&sample_fifo, sample_buffer, SAMPLE_LEN);
+#if defined(_POLY_STATS) || defined(_POLY_TRACE)
+	sample_fifo.consumer_evth = sample_fifo_evth;
+	sample_fifo.consumer_evtm = FIFO_EVT_UNDERRUN | FIFO_EVT_OVERRUN;
+#endif
+	sample_fifo.low_mark = SAMPLE_MARK;
+	sample_fifo.producer_evth = sample_refill_evth;
+	sample_fifo.producer_evtm = FIFO_EVT_LOW | FIFO_EVT_EMPTY
+		| FIFO_EVT_UNDERRUN;
+	sample_refill = 1;
+	set_sleep_mode(SLEEP_MODE_IDLE);
 
 	/* Reset the synthesizer */
 	poly_reset();
@@ -62,21 +206,8 @@ int main(void) {
 	TIMSK |= (1 << OCIE0A);		/* Enable interrupts */
 
 	/* Configure the synthesizer */
-	poly_evt.flags = POLY_EVT_TYPE_ENABLE;
-	poly_evt.value = 1;
-	poly_load(&poly_evt);
-
-	poly_evt.flags = POLY_EVT_TYPE_IFREQ;
-	poly_evt.value = 1000;
-	poly_load(&poly_evt);
-
-	poly_evt.flags = POLY_EVT_TYPE_IAMP;
-	poly_evt.value = 255;
-	poly_load(&poly_evt);
-
-	poly_evt.flags = POLY_EVT_TYPE_ASCALE;
-	poly_evt.value = 8;
-	poly_load(&poly_evt);
+	poly_load_many(synth_config, sizeof(synth_config)
+			/ sizeof(synth_config[0]), NULL);
 
 	sei();
 	while(1) {
@@ -85,20 +216,20 @@ int main(void) {
 		poly_load(&poly_evt);
 
 		while (poly_remain) {
-			while (sample_fifo.stored_sz < SAMPLE_LEN) {
-				int16_t s = poly_next();
-				fifo_write_one(&sample_fifo,
-						128 + (s >> 9));
-
-			}
-			PORTB ^= (1 << 3);
+			sample_wait();
+			uint8_t level = sample_fifo.stored_sz;
+			POLY_STATS_MIN(fifo_min, level);
+			POLY_STATS_MAX(fifo_max, level);
+			shed_load(level);
+			sample_render();
+			POLY_TRACE(POLY_TRACE_BLOCK, level, 0);
 		}
 	}
 	return 0;
 }
 
 ISR(TIM0_COMPA_vect) {
-	uint8_t sample = fifo_read_one(&sample_fifo);
+	int16_t sample = fifo_read_one(&sample_fifo);
 	if (sample >= 0)
 		OCR1B = sample;
 	else
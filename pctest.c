@@ -1,6 +1,18 @@
 #include "poly.h"
+#include "polyopt.h"
+#include "polyq.h"
+#include "polycache.h"
+#include "polysong.h"
+#include "polypar.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
 #include <ao/ao.h>
 
 const uint16_t poly_freq = 32000;
@@ -8,158 +20,786 @@ const uint16_t poly_freq_max = 16000;
 const uint8_t poly_num_channels = 8;
 struct poly_voice_t poly_voice[8];
 
-int main(int argc, char** argv) {
-	struct poly_evt_t event;
-	int voice = 0;
+/* Drawbar organ tone, filled in by make_organ() */
+static int8_t organ[POLY_WAVE_SZ];
+const int8_t* const poly_wavetable[] = { organ };
+const uint8_t poly_num_wavetables = 1;
+
+/*!
+ * Fill in the organ wave table: fundamental plus 2nd, 3rd and 4th
+ * harmonics at decreasing levels.
+ */
+static void make_organ(void) {
+	uint16_t deg;
+	for (deg = 0; deg < POLY_WAVE_SZ; deg++) {
+		double x = deg * M_PI / 180.0;
+		double y = sin(x) + 0.5*sin(2*x) + 0.33*sin(3*x)
+			+ 0.25*sin(4*x);
+		organ[deg] = lrint(y * 127.0 / 1.6);
+	}
+}
+
+#ifndef _POLY_NO_PCM
+/* PCM samples, filled in by make_pcm() */
+#define KICK_SZ		8000
+#define BUZZ_SZ		160
+static int16_t kick[KICK_SZ];
+static int8_t buzz[BUZZ_SZ];
+const struct poly_pcm_t poly_pcm[] = {
+	{ .data = kick, .len = KICK_SZ, .loop = KICK_SZ,
+		.format = POLY_PCM_S16 },
+	{ .data = buzz, .len = BUZZ_SZ, .loop = 0,
+		.format = POLY_PCM_S8 },
+};
+const uint8_t poly_num_pcm = 2;
+
+/*!
+ * Fill in the PCM samples: a kick drum, a sine sweeping down from 150 Hz
+ * to 50 Hz as it decays, played once; and one cycle of a buzz at
+ * 200 Hz, looped.
+ */
+static void make_pcm(void) {
+	double phase = 0.0;
+	uint16_t i;
+	for (i = 0; i < KICK_SZ; i++) {
+		const double t = (double)i / poly_freq;
+		phase += 2 * M_PI * (50.0 + 100.0 * exp(-t * 30.0))
+			/ poly_freq;
+		kick[i] = lrint(32767.0 * exp(-t * 12.0) * sin(phase));
+	}
+	for (i = 0; i < BUZZ_SZ; i++) {
+		const double x = 2 * M_PI * i / BUZZ_SZ;
+		buzz[i] = lrint(127.0 * (0.6*sin(x) + 0.25*sin(3*x)
+					+ 0.15*sin(5*x)));
+	}
+}
+#endif
+
+/*!
+ * Output format: signed 16-bit native-endian mono.
+ */
+static struct poly_out_t pcm_out = {
+	.format = POLY_OUT_S16,
+	.shift = 7,
+	.channels = 1,
+};
+
+#define MAX_EVENTS	4096
+static struct poly_evt_t event_buf[MAX_EVENTS];
+
+/*! Events to play: those given on the command line, or a song's */
+static const struct poly_evt_t* events = event_buf;
+
+/*!
+ * Render events from..to into the file at the given sample offset.
+ */
+static int render_segment(int fd, uint32_t from, uint32_t to,
+		uint32_t offset) {
 	int16_t samples[8192];
-	uint16_t samples_sz = 0;
-	ao_device* device;
-	ao_sample_format format;
-	ao_initialize();
-	poly_reset();
-	FILE* out = fopen("out.raw", "wb");
+	uint16_t samples_sz;
 
-	{
-		int driver = ao_default_driver_id();
-		memset(&format, 0, sizeof(format));
-		format.bits = 16;
-		format.channels = 1;
-		format.rate = poly_freq;
-		format.byte_format = AO_FMT_NATIVE;
-		device = ao_open_live(driver, &format, NULL);
-		if (!device) {
-			fprintf(stderr, "Failed to open audio device\n");
-			return 1;
+	while (from < to) {
+		uint32_t count = to - from;
+		int res = poly_load_many(&events[from],
+				(count > UINT16_MAX) ? UINT16_MAX : count,
+				NULL);
+		if (res < 0)
+			return res;
+		from += res;
+
+		while (poly_remain) {
+			samples_sz = poly_render(samples, 8192, &pcm_out);
+			if (pwrite(fd, samples, 2*samples_sz,
+					2*(off_t)offset) < 0)
+				return -errno;
+			offset += samples_sz;
 		}
 	}
+	return 0;
+}
+
+/*!
+ * Render the song to out.raw using several processes.  The song is
+ * first scanned to find keyframes that split it into roughly equal
+ * lengths, then each segment is rendered from its keyframe.
+ */
+static int render_parallel(uint32_t num_events, uint16_t jobs) {
+	struct poly_keyframe_t* keyframes;
+	uint32_t total = 0;
+	uint32_t sample = 0;
+	uint32_t evt;
+	uint16_t kf;
+	int fd;
+	int res;
+
+	keyframes = calloc(jobs + 1, sizeof(struct poly_keyframe_t));
+	if (!keyframes)
+		return -ENOMEM;
+
+	/* Pick split points at TIME event boundaries */
+	for (evt = 0; evt < num_events; evt++)
+		if ((events[evt].flags & POLY_EVT_TYPE_MASK)
+				== POLY_EVT_TYPE_TIME)
+			total += events[evt].value;
+
+	kf = 1;
+	for (evt = 0; (evt < num_events) && (kf < jobs); evt++) {
+		if ((events[evt].flags & POLY_EVT_TYPE_MASK)
+				!= POLY_EVT_TYPE_TIME)
+			continue;
+		sample += events[evt].value;
+		if (sample >= ((uint64_t)total * kf) / jobs) {
+			keyframes[kf].event = evt + 1;
+			kf++;
+		}
+	}
+	while (kf <= jobs) {
+		keyframes[kf].event = num_events;
+		kf++;
+	}
+
+	res = poly_scan(events, num_events, keyframes, jobs + 1);
+	if (res < 0)
+		goto out;
+
+	fd = open("out.raw", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		res = -errno;
+		goto out;
+	}
+
+	for (kf = 0; kf < jobs; kf++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			res = -errno;
+			break;
+		}
+		if (!pid) {
+			poly_restore(&keyframes[kf].state);
+			_exit(render_segment(fd, keyframes[kf].event,
+					keyframes[kf + 1].event,
+					keyframes[kf].sample) ? 1 : 0);
+		}
+	}
+
+	while (kf--) {
+		int status;
+		if ((wait(&status) < 0) || !WIFEXITED(status)
+				|| WEXITSTATUS(status))
+			res = -EIO;
+	}
+	close(fd);
+out:
+	free(keyframes);
+	return (res < 0) ? res : 0;
+}
+
+/*!
+ * Microseconds elapsed since the given time.
+ */
+static uint32_t elapsed_us(const struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((now.tv_sec - start->tv_sec) * 1000000)
+		+ ((now.tv_nsec - start->tv_nsec) / 1000);
+}
+
+/*!
+ * Adjust the load shedding threshold according to how much of a block's
+ * play time it took to render.  Shed a priority level if we used more
+ * than ¾ of it, restore one if we used less than ¼.
+ */
+static void shed_load(uint32_t usec, uint16_t samples) {
+	uint32_t deadline = ((uint64_t)samples * 1000000) / poly_freq;
+	if (usec > ((deadline * 3) / 4)) {
+		if (poly_shed)
+			poly_shed--;
+	} else if (usec < (deadline / 4)) {
+		if (poly_shed < POLY_PRIO_LOWEST)
+			poly_shed++;
+	}
+}
+
+/*! Live control queue, fed by control_thread() */
+#define QUEUE_SZ	256
+static struct poly_qevt_t queue_buffer[QUEUE_SZ];
+static struct poly_queue_t queue;
+
+/*! How far ahead of the sample clock events are queued */
+#define QUEUE_LEAD	(2*8192)
+
+/*! Control thread progress through the events */
+static uint32_t control_evt;
+static uint32_t control_num;
+static uint64_t control_when;
+static uint32_t control_skipped;
+
+/*!
+ * Queue the events falling before the given sample clock time.  Each
+ * is stamped with the sample it falls on; TIME events only move the
+ * stamp on.  Events the queue refuses are skipped and counted.
+ * @returns	Non-zero once every event has been queued.
+ */
+static int control_feed(uint64_t until) {
+	while (control_evt < control_num) {
+		const struct poly_evt_t* const event = &events[control_evt];
+		int res;
+		switch (event->flags & POLY_EVT_TYPE_MASK) {
+			case POLY_EVT_TYPE_TIME:
+				control_when += event->value;
+				control_evt++;
+				continue;
+			case POLY_EVT_TYPE_END:
+				control_evt = control_num;
+				return 1;
+		}
+		if (control_when >= until)
+			return 0;
+		res = poly_queue_push(&queue, control_when, event);
+		if (res == -EAGAIN)
+			return 0;	/* Full: back off */
+		if (res < 0)
+			control_skipped++;
+		control_evt++;
+	}
+	return 1;
+}
+
+/*!
+ * Feed the live control queue as a user interface thread would,
+ * keeping QUEUE_LEAD samples ahead of playback.
+ */
+static void* control_thread(void* arg) {
+	const struct timespec backoff = { .tv_nsec = 1000000 };
+	(void)arg;
+	while (!control_feed(poly_queue_clock(&queue) + QUEUE_LEAD))
+		nanosleep(&backoff, NULL);
+	return NULL;
+}
+
+/*! Parallel renderer, used if par_threads is non-zero */
+static struct poly_par_t par;
+static int par_threads;
+
+/*!
+ * Render a block, time it and play it.
+ * @param	queued	Apply events from the live control queue.
+ */
+static void play_block(ao_device* device, FILE* out, int queued) {
+	int16_t samples[8192];
+	struct timespec start;
+	uint32_t usec;
+	int samples_sz;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	/* Fill the buffer as much as we can */
+	samples_sz = queued
+		? poly_queue_render(&queue, samples, 8192, &pcm_out)
+		: par_threads
+		? poly_par_render(&par, samples, 8192, &pcm_out)
+		: poly_render(samples, 8192, &pcm_out);
+	usec = elapsed_us(&start);
+	shed_load(usec, samples_sz);
+#ifdef _POLY_STATS
+	poly_stats_block(usec);
+#endif
+	POLY_TRACE(POLY_TRACE_BLOCK, 0, (usec > UINT16_MAX)
+			? UINT16_MAX : usec);
+	fwrite(samples, samples_sz, 2, out);
+	ao_play(device, (char*)samples, 2*samples_sz);
+}
+
+/*!
+ * Play the events through the live control queue: the synthesizer runs
+ * one long segment while a control thread queues the events.
+ */
+static int play_queued(ao_device* device, FILE* out,
+		uint32_t num_events) {
+	struct poly_queue_stats_t stats;
+	uint64_t total = 0;
+	pthread_t thread;
+	uint32_t evt;
+	int res;
+
+	/* Play up to the first END */
+	for (evt = 0; evt < num_events; evt++) {
+		const uint16_t type = events[evt].flags & POLY_EVT_TYPE_MASK;
+		if (type == POLY_EVT_TYPE_END)
+			break;
+		if (type == POLY_EVT_TYPE_TIME)
+			total += events[evt].value;
+	}
+
+	poly_queue_init(&queue, queue_buffer, QUEUE_SZ);
+	control_num = evt;
+	control_feed(QUEUE_LEAD);
+	res = pthread_create(&thread, NULL, control_thread, NULL);
+	if (res)
+		return -res;
+
+	while (poly_queue_clock(&queue) < total) {
+		if (!poly_remain) {
+			const uint64_t left = total
+				- poly_queue_clock(&queue);
+			struct poly_evt_t time = {
+				.flags = POLY_EVT_TYPE_TIME,
+				.value = (left > UINT16_MAX)
+					? UINT16_MAX : left,
+			};
+			poly_load(&time);
+		}
+		play_block(device, out, 1);
+	}
+	pthread_join(thread, NULL);
+
+	poly_queue_stats(&queue, &stats);
+	fprintf(stderr, "queue: %u pushed, %u refused (full), "
+			"%u applied, %u rejected, peak %u\n",
+			stats.pushed, stats.refused, stats.applied,
+			stats.rejected, stats.peak);
+	fprintf(stderr, "queue: %u late, by up to %u samples\n",
+			stats.late, stats.late_max);
+	if (control_skipped)
+		fprintf(stderr, "queue: %u events skipped\n",
+				control_skipped);
+	return 0;
+}
+
+/*! Clip cache budget */
+#define CACHE_BUDGET	(16 << 20)
+
+/*!
+ * Play the events as a sound effect, the given number of times, taking
+ * the samples from the clip cache rather than the synthesizer.  Each
+ * repeat starts half way through the last, so they are mixed.
+ */
+static int play_cached(ao_device* device, FILE* out, uint32_t num_events,
+		int repeat) {
+	struct poly_cache_t cache;
+	struct poly_cache_stats_t stats;
+	struct poly_clip_t* clip[2] = { NULL, NULL };
+	uint32_t pos[2] = { 0, 0 };
+	int32_t wide[8192];
+	int16_t samples[8192];
+	int res;
+
+	res = poly_cache_init(&cache, poly_num_channels, poly_freq,
+			CACHE_BUDGET);
+	if (res < 0)
+		return res;
+
+	while (repeat || clip[0] || clip[1]) {
+		uint32_t len = 8192;
+		uint32_t i;
+		uint8_t c;
+
+		/* Start the next repeat once the newest is half played */
+		for (c = 0; c < 2; c++) {
+			const struct poly_clip_t* other = clip[!c];
+			if (clip[c] || !repeat || (other
+					&& (pos[!c] < (other->len / 2))))
+				continue;
+			res = poly_cache_get(&cache, NULL, events,
+					num_events, &clip[c]);
+			if (res < 0)
+				goto out;
+			pos[c] = 0;
+			repeat--;
+		}
+
+		/* Mix up to the next point where a clip ends or starts */
+		for (c = 0; c < 2; c++) {
+			if (!clip[c])
+				continue;
+			if ((clip[c]->len - pos[c]) < len)
+				len = clip[c]->len - pos[c];
+			if (repeat && !clip[!c] && (pos[c] < (clip[c]->len / 2))
+					&& (((clip[c]->len / 2) - pos[c]) < len))
+				len = (clip[c]->len / 2) - pos[c];
+		}
+
+		memset(samples, 0, sizeof(samples));
+		for (c = 0; c < 2; c++) {
+			if (!clip[c])
+				continue;
+			pos[c] += poly_clip_mix(clip[c], pos[c], samples, len);
+			if (pos[c] >= clip[c]->len) {
+				poly_cache_put(&cache, clip[c]);
+				clip[c] = NULL;
+			}
+		}
+
+		/* Same gain as pcm_out */
+		for (i = 0; i < len; i++) {
+			wide[i] = (int32_t)samples[i] << pcm_out.shift;
+			samples[i] = (wide[i] > INT16_MAX) ? INT16_MAX
+				: (wide[i] < INT16_MIN) ? INT16_MIN : wide[i];
+		}
+		fwrite(samples, len, 2, out);
+		ao_play(device, (char*)samples, 2*len);
+	}
+
+out:
+	poly_cache_stats(&cache, &stats);
+	fprintf(stderr, "cache: %u hits, %u misses, %u clips, %zu bytes\n",
+			stats.hits, stats.misses, stats.clips, stats.bytes);
+	poly_cache_clear(&cache);
+	return res;
+}
+
+#ifdef _POLY_STATS
+/*!
+ * Dump the performance counters.
+ */
+static void print_stats(void) {
+	uint8_t bucket;
+	fprintf(stderr, "samples:      %u\n", poly_stats.samples);
+	fprintf(stderr, "computed:     %u (%.2f voices/sample)\n",
+			poly_stats.computed, poly_stats.samples
+			? (double)poly_stats.computed / poly_stats.samples
+			: 0.0);
+	fprintf(stderr, "clipped:      %u\n", poly_stats.clipped);
+	fprintf(stderr, "rejected:     EINVAL %u, ERANGE %u, "
+			"EINPROGRESS %u\n", poly_stats.einval,
+			poly_stats.erange, poly_stats.einprogress);
+	fprintf(stderr, "block render times:\n");
+	for (bucket = 0; bucket < POLY_STATS_HIST_SZ; bucket++) {
+		if (!poly_stats.block_hist[bucket])
+			continue;
+		fprintf(stderr, "  < %8u us: %u\n", 1U << bucket,
+				poly_stats.block_hist[bucket]);
+	}
+}
+#endif
+
+int main(int argc, char** argv) {
+	struct poly_evt_t* event = event_buf;
+	int voice = 0;
+	uint32_t num_events = 0;
+	uint32_t evt;
+	int jobs = 0;
+	int optimise = 0;
+	int queued = 0;
+	int cached = 0;
+	const char* trace = NULL;
+	const char* song_in = NULL;
+	const char* song_out = NULL;
+	struct poly_song_t song;
+	ao_device* device;
+	ao_sample_format format;
 
 	argc--;
 	argv++;
 	while (argc > 0) {
-		int res = 0;
+		if ((argc > 1) && !strcmp(argv[0], "-j")) {
+			jobs = atoi(argv[1]);
+			argv += 2;
+			argc -= 2;
+		} else if (!strcmp(argv[0], "-O")) {
+			optimise = 1;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "-q")) {
+			queued = 1;
+			argv++;
+			argc--;
+		} else if ((argc > 1) && !strcmp(argv[0], "-c")) {
+			cached = atoi(argv[1]);
+			argv += 2;
+			argc -= 2;
+		} else if ((argc > 1) && !strcmp(argv[0], "-p")) {
+			par_threads = atoi(argv[1]);
+			argv += 2;
+			argc -= 2;
+		} else if ((argc > 1) && !strcmp(argv[0], "-s")) {
+			song_in = argv[1];
+			argv += 2;
+			argc -= 2;
+		} else if ((argc > 1) && !strcmp(argv[0], "-w")) {
+			song_out = argv[1];
+			argv += 2;
+			argc -= 2;
+		} else if ((argc > 1) && !strcmp(argv[0], "-t")) {
+			trace = argv[1];
+			argv += 2;
+			argc -= 2;
+		} else {
+			break;
+		}
+	}
+
+	while ((argc > 0) && (num_events < MAX_EVENTS)) {
+		int valid = 1;
 		if (!strcmp(argv[0], "end"))
 			break;
 		if (!strcmp(argv[0], "voice")) {
 			voice = atoi(argv[1]);
+			valid = 0;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "mute")) {
 			int mute = atoi(argv[1]);
-			event.flags = POLY_EVT_TYPE_MUTE;
-			event.value = mute;
-			res = poly_load(&event);
+			event->flags = POLY_EVT_TYPE_MUTE;
+			event->value = mute;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "en")) {
 			int en = atoi(argv[1]);
-			event.flags = POLY_EVT_TYPE_ENABLE;
-			event.value = en;
-			res = poly_load(&event);
+			event->flags = POLY_EVT_TYPE_ENABLE;
+			event->value = en;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "freq")) {
 			int freq = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_IFREQ;
-			event.value = freq;
-			res = poly_load(&event);
+			event->value = freq;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "dfreq")) {
 			int freq = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_DFREQ;
-			event.value = freq;
-			res = poly_load(&event);
+			event->value = freq;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "ascale")) {
 			int amp = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_ASCALE;
-			event.value = amp;
-			res = poly_load(&event);
+			event->value = amp;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "amp")) {
 			int amp = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_IAMP;
-			event.value = amp;
-			res = poly_load(&event);
+			event->value = amp;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "damp")) {
 			int damp = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_DAMP;
-			event.value = damp;
-			res = poly_load(&event);
+			event->value = damp;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "prio")) {
+			int prio = atoi(argv[1]);
+			event->flags = (voice << POLY_CH_BIT)
+				| POLY_EVT_TYPE_PRIO;
+			event->value = prio;
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "wave")) {
+			int wave = atoi(argv[1]);
+			event->flags = (voice << POLY_CH_BIT)
+				| POLY_EVT_TYPE_WAVE;
+			event->value = wave;
+			argv++;
+			argc--;
+#ifndef _POLY_NO_PCM
+		} else if (!strcmp(argv[0], "pcm")) {
+			int pcm = atoi(argv[1]);
+			event->flags = (voice << POLY_CH_BIT)
+				| POLY_EVT_TYPE_PCM;
+			event->value = pcm;
+			argv++;
+			argc--;
+#endif
+		} else if (!strcmp(argv[0], "rate")) {
+			/* Negative divider: interpolate */
+			int rate = atoi(argv[1]);
+			event->flags = (voice << POLY_CH_BIT)
+				| POLY_EVT_TYPE_RATE;
+			event->value = (rate < 0)
+				? (-rate | POLY_RATE_INTERP) : rate;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "pmod")) {
 			int pmod = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_PMOD;
-			event.value = pmod;
-			res = poly_load(&event);
+			event->value = pmod;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "amod")) {
 			int amod = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_AMOD;
-			event.value = amod;
-			res = poly_load(&event);
+			event->value = amod;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "dscale")) {
 			int dt = atoi(argv[1]);
-			event.flags = (voice << POLY_CH_BIT)
+			event->flags = (voice << POLY_CH_BIT)
 				| POLY_EVT_TYPE_DSCALE;
-			event.value = dt;
-			res = poly_load(&event);
+			event->value = dt;
 			argv++;
 			argc--;
 		} else if (!strcmp(argv[0], "time")) {
 			int time = atoi(argv[1]);
 			argv++;
 			argc--;
-			event.flags = POLY_EVT_TYPE_TIME;
-			event.value = time;
-			res = poly_load(&event);
+			event->flags = POLY_EVT_TYPE_TIME;
+			event->value = time;
+		} else {
+			valid = 0;
 		}
-		if (res < 0) {
-			fprintf(stderr, "Failed: %s\n",
-					strerror(-res));
-			break;
+		if (valid) {
+			event++;
+			num_events++;
 		}
 		argv++;
 		argc--;
+	}
 
-		/* Play out any remaining samples */
-		while (poly_remain) {
-			int16_t* sample_ptr = samples;
-			uint16_t samples_remain = 8192;
-			/* Fill the buffer as much as we can */
-			while (poly_remain && samples_remain) {
-				int16_t s = poly_next();
-				//printf("%d: %d\n", samples_sz, s);
-				*sample_ptr = s << 7;
-				sample_ptr++;
-				samples_sz++;
-				samples_remain--;
-			}
-			fwrite(samples, samples_sz, 2, out);
-			ao_play(device, (char*)samples, 2*samples_sz);
-			samples_sz = 0;
+	make_organ();
+#ifndef _POLY_NO_PCM
+	make_pcm();
+#endif
+	poly_reset();
+
+	if (song_in) {
+		int res = poly_song_open(&song, song_in);
+		if (res < 0) {
+			fprintf(stderr, "%s: %s\n", song_in, strerror(-res));
+			return 1;
+		}
+		if ((song.hdr->num_channels > poly_num_channels)
+				|| (song.hdr->freq != poly_freq)) {
+			fprintf(stderr, "%s: written for %u channels "
+					"at %u Hz\n", song_in,
+					song.hdr->num_channels,
+					song.hdr->freq);
+			return 1;
+		}
+		if (optimise) {
+			fprintf(stderr, "%s: cannot optimise a mapped "
+					"song\n", song_in);
+			return 1;
+		}
+		events = song.events;
+		num_events = song.hdr->num_events;
+	}
+
+	if (optimise) {
+		struct poly_opt_stats_t stats;
+		uint32_t failed = 0;
+		int32_t res = poly_optimise(event_buf, num_events,
+				poly_num_channels, poly_freq,
+				&failed, &stats);
+		if (res < 0) {
+			fprintf(stderr, "Failed at event %u: %s\n",
+					failed, strerror(-res));
+			return 1;
+		}
+		fprintf(stderr, "Optimised %u events to %d: "
+				"%u redundant, %u dead, %u TIME\n",
+				num_events, res, stats.redundant,
+				stats.dead, stats.time);
+		num_events = res;
+	}
+
+	if (song_out) {
+		int res = poly_song_write(song_out, poly_num_channels,
+				poly_freq, events, num_events, 1);
+		if (res < 0) {
+			fprintf(stderr, "%s: %s\n", song_out, strerror(-res));
+			return 1;
+		}
+	}
+
+	if (jobs > 0) {
+		int res = render_parallel(num_events, jobs);
+		if (res < 0) {
+			fprintf(stderr, "Failed: %s\n", strerror(-res));
+			return 1;
+		}
+		return 0;
+	}
+
+	ao_initialize();
+	FILE* out = fopen("out.raw", "wb");
+
+	{
+		int driver = ao_default_driver_id();
+		memset(&format, 0, sizeof(format));
+		format.bits = 16;
+		format.channels = 1;
+		format.rate = poly_freq;
+		format.byte_format = AO_FMT_NATIVE;
+		device = ao_open_live(driver, &format, NULL);
+		if (!device) {
+			fprintf(stderr, "Failed to open audio device\n");
+			return 1;
+		}
+	}
+
+	if (par_threads) {
+		int res = poly_par_init(&par, par_threads);
+		if (res < 0) {
+			fprintf(stderr, "Failed to start %d threads: %s\n",
+					par_threads, strerror(-res));
+			return 1;
 		}
 	}
 
+	if (queued) {
+		int res = play_queued(device, out, num_events);
+		if (res < 0)
+			fprintf(stderr, "Failed: %s\n", strerror(-res));
+		num_events = 0;
+	} else if (cached > 0) {
+		int res = play_cached(device, out, num_events, cached);
+		if (res < 0)
+			fprintf(stderr, "Failed: %s\n", strerror(-res));
+		num_events = 0;
+	}
+
+	evt = 0;
+	while (evt < num_events) {
+		uint32_t count = num_events - evt;
+		uint16_t failed;
+		int res = poly_load_many(&events[evt],
+				(count > UINT16_MAX) ? UINT16_MAX : count,
+				&failed);
+		if (res < 0) {
+			fprintf(stderr, "Failed at event %u: %s\n",
+					evt + failed, strerror(-res));
+			break;
+		}
+		evt += res;
+
+		/* Play out any remaining samples */
+		while (poly_remain)
+			play_block(device, out, 0);
+	}
+
 	poly_reset();
 	fclose(out);
+	if (par_threads)
+		poly_par_free(&par);
+#ifdef _POLY_STATS
+	print_stats();
+#endif
+	if (trace) {
+#ifdef _POLY_TRACE
+		FILE* dump = fopen(trace, "wb");
+		if (dump) {
+			fwrite(&poly_trace, sizeof(poly_trace), 1, dump);
+			fclose(dump);
+		} else {
+			perror(trace);
+		}
+#else
+		fprintf(stderr, "Built without _POLY_TRACE\n");
+#endif
+	}
 
 	ao_close(device);
 	ao_shutdown();
+	if (song_in)
+		poly_song_close(&song);
 	return 0;
 }
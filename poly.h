@@ -91,7 +91,8 @@ struct poly_evt_t {
 /*!
  * DFREQ change event.  This indicates the frequency step is to change to
  * the given value in Hz.  The frequency of the channel will step by this
- * amount every N samples, where N is set by DSCALE.
+ * amount every N samples, where N is set by DSCALE.  Not available if
+ * _POLY_NO_RAMP is defined.
  *
  * Channel number is given in bits 12-8 of the flags register.
  */
@@ -102,11 +103,22 @@ struct poly_evt_t {
  *
  * If value is UINT16_MAX: Disable phase modulation
  * Otherwise, modulate the phase using the channel number given.
+ * Not available if _POLY_NO_MOD is defined.
  *
  * Channel number is given in bits 12-8 of the flags register.
  */
 #define POLY_EVT_TYPE_PMOD	(0x06 << POLY_EVT_TYPE_BIT)
 
+/*!
+ * PRIO change event.  Set the priority of the channel, from 0 (most
+ * important, the default) to POLY_PRIO_LOWEST.  When the renderer falls
+ * behind, the front end may shed channels of lower importance; see
+ * poly_shed.
+ *
+ * Channel number is given in bits 12-8 of the flags register.
+ */
+#define POLY_EVT_TYPE_PRIO	(0x07 << POLY_EVT_TYPE_BIT)
+
 /*!
  * IAMP change event.  This indicates the immediate amplitude of the
  * channel is to be set to the value given.
@@ -118,7 +130,8 @@ struct poly_evt_t {
 /*!
  * DAMP change event.  This indicates the amplitude step is to change to
  * the given value.  The amplitude will change by this amount every N
- * samples, where N is set by DSCALE.
+ * samples, where N is set by DSCALE.  Not available if _POLY_NO_RAMP
+ * is defined.
  *
  * Channel number is given in bits 12-8 of the flags register.
  */
@@ -129,6 +142,7 @@ struct poly_evt_t {
  *
  * If value is UINT16_MAX: Disable amplitude modulation
  * Otherwise, modulate the amplitude using the channel number given.
+ * Not available if _POLY_NO_MOD is defined.
  *
  * Channel number is given in bits 12-8 of the flags register.
  */
@@ -142,9 +156,56 @@ struct poly_evt_t {
  */
 #define POLY_EVT_TYPE_ASCALE	(0x0b << POLY_EVT_TYPE_BIT)
 
+/*!
+ * WAVE change event.  Select the waveform the channel generates when
+ * its frequency is non-zero; one of the POLY_WAVE_* values below.  The
+ * waveform is ignored for noise (frequency UINT16_MAX) and DC.
+ *
+ * Channel number is given in bits 12-8 of the flags register.
+ */
+#define POLY_EVT_TYPE_WAVE	(0x0c << POLY_EVT_TYPE_BIT)
+
+/*!
+ * RATE change event.  Evaluate the channel only every N samples, given
+ * in bits 7-0 of the value (0 or 1: every sample, up to
+ * POLY_RATE_DIV_MAX).  In between, the last value is held, or if
+ * POLY_RATE_INTERP is set in the value, the output moves linearly from
+ * the previous value to the newly evaluated one over the N samples
+ * (delaying it by one period).  Intended for modulation sources such as
+ * low-frequency oscillators.  Not available if _POLY_NO_RATE is defined.
+ *
+ * Channel number is given in bits 12-8 of the flags register.
+ */
+#define POLY_EVT_TYPE_RATE	(0x0d << POLY_EVT_TYPE_BIT)
+
+/*!
+ * Linear interpolation flag for the RATE event.
+ */
+#define POLY_RATE_INTERP	(1 << 15)
+
+/*!
+ * Maximum rate divider.
+ */
+#define POLY_RATE_DIV_MAX	(128)
+
+/*!
+ * PCM change event.  Play the user-supplied PCM sample given in the
+ * value (see poly_pcm) instead of a waveform, until the next WAVE
+ * event.  The frequency register becomes the playback rate, in 1/256ths
+ * of a sample per output sample (POLY_PCM_RATE_ONE plays at the
+ * recorded rate), and IFREQ restarts the sample.  Amplitude, ramps and
+ * modulation work as for any other voice; phase modulation offsets the
+ * position in the sample by the modulating channel's output.
+ * Not available if _POLY_NO_PCM is defined.
+ *
+ * Channel number is given in bits 12-8 of the flags register.
+ */
+#define POLY_EVT_TYPE_PCM	(0x0e << POLY_EVT_TYPE_BIT)
+
 /*!
  * DSCALE change event.  Every N samples (given here), the amplitude and
  * frequency of the channel will be adjusted.
+ * Not available if _POLY_NO_RAMP is defined.
  *
  * Channel number is given in bits 12-8 of the flags register.
  */
@@ -160,6 +221,58 @@ struct poly_evt_t {
  */
 #define POLY_CH_MASK		(0x0f << POLY_VOICE_CH_BIT)
 
+/*!
+ * Position of the priority field in the voice flags register.
+ */
+#define POLY_PRIO_BIT		(5)
+
+/*!
+ * Mask for the priority field in the voice flags register.
+ */
+#define POLY_PRIO_MASK		(0x07 << POLY_PRIO_BIT)
+
+/*!
+ * Least important priority level.
+ */
+#define POLY_PRIO_LOWEST	(7)
+
+/*!
+ * PCM flag in the voice flags register: the voice plays the PCM sample
+ * numbered in the waveform field.
+ */
+#define POLY_PCM		(0x10)
+
+/*!
+ * Mask for the waveform field in the voice flags register.
+ */
+#define POLY_WAVE_MASK		(0x0f)
+
+/*! Sinusoidal waveform (the default) */
+#define POLY_WAVE_SINE		(0)
+/*! Square waveform */
+#define POLY_WAVE_SQUARE	(1)
+/*! Rising sawtooth waveform */
+#define POLY_WAVE_SAW		(2)
+/*! Triangle waveform */
+#define POLY_WAVE_TRIANGLE	(3)
+/*! User-supplied wave table N, see poly_wavetable */
+#define POLY_WAVE_TABLE(n)	(4 + (n))
+
+/*!
+ * Maximum number of user-supplied wave tables.
+ */
+#define POLY_WAVE_TABLES	(12)
+
+/*!
+ * Number of entries in a user-supplied wave table: one per degree.
+ */
+#define POLY_WAVE_SZ		(360)
+
+/*!
+ * Maximum number of voice channels supported by the event format.
+ */
+#define POLY_MAX_CHANNELS	(16)
+
 /*!
  * Voice state machine.  A "voice" is simply a sinusoidal channel.  It
  * may be modulated by a static linear function, or by taking the output
@@ -167,21 +280,117 @@ struct poly_evt_t {
  *
  * Each voice has its own sample timing counter which starts at zero and
  * counts upwards.
+ *
+ * Fields belonging to features left out with _POLY_NO_RAMP, _POLY_NO_MOD,
+ * _POLY_NO_RATE or _POLY_NO_PCM are dropped.  The engine reaches the modulation and
+ * amplitude scale fields through accessors in poly_core.h, as their
+ * layout depends on _POLY_PACKED.
  */
+#ifndef _POLY_PACKED
 struct poly_voice_t {
 	int16_t		sample;	/*!< Sample last computed */
 	uint16_t	time;	/*!< Time (samples) for voice */
 	uint16_t	freq;	/*!< Current frequency */
+#ifndef _POLY_NO_PCM
+	uint16_t	pos;	/*!< PCM sample position */
+#endif
+#ifndef _POLY_NO_RAMP
 	int16_t		dfreq;	/*!< Delta frequency */
 	uint16_t	dscale;	/*!< Delta time scale */
+#endif
 	uint8_t		amp;	/*!< Current amplitude */
+#ifndef _POLY_NO_RAMP
 	int8_t		damp;	/*!< Delta amplitude */
+#endif
 	uint8_t		ascale;	/*!< Amplitude scale */
+#ifndef _POLY_NO_MOD
 	uint8_t		pmod;	/*!< Phase modulation channel */
 	uint8_t		amod;	/*!< Amplitude modulation channel */
+#endif
 	uint8_t		flags;	/*!< Flags register */
+#ifndef _POLY_NO_RATE
+	uint8_t		rdiv;	/*!< Rate divider - 1, interpolate flag */
+	uint8_t		rcnt;	/*!< Samples until next evaluation */
+	int16_t		rstep;	/*!< Interpolation step per sample */
+#endif
+};
+#else
+/*
+ * Packed voice layout: the modulation routing and amplitude scale share
+ * one 16-bit routing register, and 16-bit fields come first so hosts do
+ * not pad between them.
+ */
+struct poly_voice_t {
+	int16_t		sample;	/*!< Sample last computed */
+	uint16_t	time;	/*!< Time (samples) for voice */
+	uint16_t	freq;	/*!< Current frequency */
+#ifndef _POLY_NO_PCM
+	uint16_t	pos;	/*!< PCM sample position */
+#endif
+#ifndef _POLY_NO_RAMP
+	int16_t		dfreq;	/*!< Delta frequency */
+	uint16_t	dscale;	/*!< Delta time scale */
+#endif
+#ifndef _POLY_NO_MOD
+	uint16_t	route;	/*!< Routing register, see POLY_ROUTE_* */
+#endif
+#ifndef _POLY_NO_RATE
+	int16_t		rstep;	/*!< Interpolation step per sample */
+#endif
+	uint8_t		amp;	/*!< Current amplitude */
+#ifndef _POLY_NO_RAMP
+	int8_t		damp;	/*!< Delta amplitude */
+#endif
+#ifdef _POLY_NO_MOD
+	uint8_t		ascale;	/*!< Amplitude scale */
+#endif
+	uint8_t		flags;	/*!< Flags register */
+#ifndef _POLY_NO_RATE
+	uint8_t		rdiv;	/*!< Rate divider - 1, interpolate flag */
+	uint8_t		rcnt;	/*!< Samples until next evaluation */
+#endif
 };
 
+/*!
+ * Routing register fields, each 5 bits wide.  The modulation fields
+ * hold a channel number in bits 3-0, with bit 4 set if enabled.
+ */
+#define POLY_ROUTE_PMOD_BIT	(0)
+#define POLY_ROUTE_AMOD_BIT	(5)
+#define POLY_ROUTE_ASCALE_BIT	(10)
+#define POLY_ROUTE_FIELD_MASK	(0x1f)
+#define POLY_ROUTE_MOD_EN	(0x10)
+#endif
+
+/*!
+ * Size in bytes of a voice channel, without any padding the host adds.
+ * On AVR this is exactly sizeof(struct poly_voice_t).
+ */
+#define POLY_VOICE_SZ	(8 + _POLY_VOICE_SZ_RAMP + _POLY_VOICE_SZ_MOD \
+		+ _POLY_VOICE_SZ_RATE + _POLY_VOICE_SZ_PCM)
+#ifndef _POLY_NO_RAMP
+#define _POLY_VOICE_SZ_RAMP	(5)
+#else
+#define _POLY_VOICE_SZ_RAMP	(0)
+#endif
+#if defined(_POLY_NO_MOD)
+#define _POLY_VOICE_SZ_MOD	(1)
+#elif defined(_POLY_PACKED)
+#define _POLY_VOICE_SZ_MOD	(2)
+#else
+#define _POLY_VOICE_SZ_MOD	(3)
+#endif
+#ifndef _POLY_NO_RATE
+#define _POLY_VOICE_SZ_RATE	(4)
+#else
+#define _POLY_VOICE_SZ_RATE	(0)
+#endif
+#ifndef _POLY_NO_PCM
+#define _POLY_VOICE_SZ_PCM	(2)
+#else
+#define _POLY_VOICE_SZ_PCM	(0)
+#endif
+
 #ifndef _POLY_NUM_CHANNELS
 /*!
  * Number of voice channels: this needs to be declared in the application.
@@ -213,17 +422,348 @@ extern const uint16_t __attribute__((weak)) poly_freq_max;
 #define poly_freq_max		(poly_freq/2)
 #endif
 
+/*!
+ * User-supplied wave tables: these may be declared in the application.
+ * Each table is a single cycle of POLY_WAVE_SZ signed samples.  On AVR,
+ * both the tables and this array of pointers are stored in PROGMEM.
+ */
+extern const int8_t* const __attribute__((weak)) poly_wavetable[];
+
+/*!
+ * Number of user-supplied wave tables in poly_wavetable.
+ */
+extern const uint8_t __attribute__((weak)) poly_num_wavetables;
+
+#ifndef _POLY_NO_PCM
+/*! PCM sample formats: signed 8-bit, or signed native-endian 16-bit */
+#define POLY_PCM_S8		(1)
+#define POLY_PCM_S16		(2)
+
+/*! Maximum number of user-supplied PCM samples */
+#define POLY_PCM_SAMPLES	(16)
+
+/*! Playback rate that plays a PCM sample at its recorded rate */
+#define POLY_PCM_RATE_ONE	(256)
+
+/*!
+ * User-supplied PCM sample.  Once the end is reached, playback carries
+ * on from the loop point, or falls silent until the next IFREQ if there
+ * is none.
+ */
+struct poly_pcm_t {
+	const void*	data;	/*!< Sample data */
+	uint16_t	len;	/*!< Length in samples */
+	uint16_t	loop;	/*!< Loop start, or len to play once */
+	uint8_t		format;	/*!< POLY_PCM_S8 or POLY_PCM_S16 */
+};
+
+/*!
+ * User-supplied PCM samples: these may be declared in the application.
+ * On AVR, both the sample data and this array are stored in PROGMEM.
+ */
+extern const struct poly_pcm_t __attribute__((weak)) poly_pcm[];
+
+/*!
+ * Number of user-supplied PCM samples in poly_pcm.
+ */
+extern const uint8_t __attribute__((weak)) poly_num_pcm;
+#endif
+
 #ifndef _POLY_NUM_CHANNELS
 /*!
  * Voice channel array: this needs to be declared in the application.
  */
-extern struct __attribute__((weak)) poly_voice_t poly_voice[];
+extern struct poly_voice_t __attribute__((weak)) poly_voice[];
+#endif
+
+#ifdef _POLY_STATS
+/*!
+ * Number of buckets in the block render time histogram.
+ */
+#define POLY_STATS_HIST_SZ	(16)
+
+/*!
+ * Performance counters.  These are maintained only when _POLY_STATS is
+ * defined; otherwise the counter macros below compile to nothing.
+ */
+struct poly_stats_t {
+	uint32_t	samples;	/*!< Samples emitted */
+	uint32_t	computed;	/*!< Voice samples computed */
+	uint32_t	clipped;	/*!< Voice samples clipped */
+	uint32_t	shed;		/*!< Voice samples shed */
+	uint16_t	einval;		/*!< Events rejected: bad event */
+	uint16_t	erange;		/*!< Events rejected: bad value */
+	uint16_t	einprogress;	/*!< Events rejected: in progress */
+	uint16_t	underrun;	/*!< Output FIFO underruns */
+	uint16_t	overrun;	/*!< Output FIFO overruns */
+	uint8_t		fifo_min;	/*!< Output FIFO low-water mark */
+	uint8_t		fifo_max;	/*!< Output FIFO high-water mark */
+#ifndef __AVR_ARCH__
+	/*!
+	 * Block render time histogram.  Bucket N counts blocks that took
+	 * between 2^(N-1) and 2^N microseconds to render.
+	 */
+	uint32_t	block_hist[POLY_STATS_HIST_SZ];
+#endif
+};
+
+/*!
+ * Performance counters.
+ */
+extern struct poly_stats_t poly_stats;
+
+#define POLY_STATS_INC(field)		(poly_stats.field++)
+#define POLY_STATS_MIN(field, value)	do {			\
+		if ((value) < poly_stats.field)			\
+			poly_stats.field = (value);		\
+	} while(0)
+#define POLY_STATS_MAX(field, value)	do {			\
+		if ((value) > poly_stats.field)			\
+			poly_stats.field = (value);		\
+	} while(0)
+#else
+#define POLY_STATS_INC(field)
+#define POLY_STATS_MIN(field, value)
+#define POLY_STATS_MAX(field, value)
+#endif
+
+/*!
+ * Trace record types.  Each record carries the sample clock, a type,
+ * an 8-bit argument and a 16-bit value, interpreted as follows.
+ */
+/*! Sample clock reached a multiple of 65536; value: clock >> 16 */
+#define POLY_TRACE_WRAP		(0)
+/*! Event applied; arg: event flags >> 8; value: event value */
+#define POLY_TRACE_EVENT	(1)
+/*! Event rejected; arg: event flags >> 8; value: error number */
+#define POLY_TRACE_REJECT	(2)
+/*! Frequency ramp step; arg: channel; value: new frequency */
+#define POLY_TRACE_FREQ		(3)
+/*! Amplitude ramp step; arg: channel; value: new amplitude */
+#define POLY_TRACE_AMP		(4)
+/*!
+ * Ramp stopped at a limit; arg: channel, with POLY_TRACE_CLAMP_AMP set
+ * for amplitude; value: the limit.
+ */
+#define POLY_TRACE_CLAMP	(5)
+#define POLY_TRACE_CLAMP_AMP	(0x80)
+/*! Voice sample clipped; arg: channel; value: INT16_MAX or INT16_MIN */
+#define POLY_TRACE_CLIP		(6)
+/*! Output FIFO event; arg: FIFO_EVT_* flags; value: FIFO level */
+#define POLY_TRACE_FIFO		(7)
+/*!
+ * Block rendered, recorded at its end; arg: output FIFO level when it
+ * started, or 0; value: render time in microseconds, or 0 if unknown.
+ */
+#define POLY_TRACE_BLOCK	(8)
+/*! First type free for applications */
+#define POLY_TRACE_USER		(12)
+
+#ifdef _POLY_TRACE
+#ifndef _POLY_TRACE_SZ
+/*!
+ * Trace ring size in records: a power of two.  Each record takes six
+ * bytes.
+ */
+#ifdef __AVR_ARCH__
+#define _POLY_TRACE_SZ		(32)
+#else
+#define _POLY_TRACE_SZ		(4096)
+#endif
+#endif
+
+/*!
+ * Trace record.
+ */
+struct poly_trace_t {
+	uint16_t	time;	/*!< Sample clock, low 16 bits */
+	uint8_t		type;	/*!< Record type, POLY_TRACE_* */
+	uint8_t		arg;	/*!< Argument */
+	uint16_t	value;	/*!< Value */
+};
+
+/*!
+ * Trace ring.  Records overwrite the oldest once the ring is full.
+ * The layout has no padding, so a memory dump of the ring (taken with
+ * a debugger, or written out by the host) is the same on AVR and a
+ * little-endian host, and can be read by polytrace.
+ */
+struct poly_trace_ring_t {
+	uint32_t	clock;	/*!< Samples rendered */
+	uint32_t	head;	/*!< Records written since reset */
+	uint16_t	mask;	/*!< Types recorded: bit N for type N */
+	uint16_t	size;	/*!< Number of records in rec */
+	struct poly_trace_t	rec[_POLY_TRACE_SZ];	/*!< Records */
+};
+
+/*!
+ * Trace ring for the C API instance.  Clear bits in mask to leave out
+ * record types that would flood it, such as ramp steps.
+ */
+extern struct poly_trace_ring_t poly_trace;
+
+/*!
+ * Clear the trace ring and the sample clock.  All record types are
+ * enabled.
+ */
+void poly_trace_reset();
+
+/*!
+ * Add a record to the trace ring, stamped with the sample clock.  May
+ * be called from an interrupt handler.
+ * @param	type		Record type, POLY_TRACE_*.
+ * @param	arg		Argument.
+ * @param	value		Value.
+ */
+void poly_trace_record(uint8_t type, uint8_t arg, uint16_t value);
+
+#define POLY_TRACE(type, arg, value)	\
+	poly_trace_record((type), (arg), (value))
+#else
+#define POLY_TRACE(type, arg, value)
+#endif
+
+/*!
+ * Engine configuration: the voice channel array and the constants the
+ * engine runs at.
+ */
+struct poly_cfg_t {
+	struct poly_voice_t*	voice;		/*!< Voice channel array */
+	uint8_t			num_channels;	/*!< Number of channels */
+	uint16_t		freq;		/*!< Sample rate */
+	uint16_t		freq_max;	/*!< Maximum frequency */
+};
+
+/*!
+ * Synthesizer instance.  The C API drives a single global instance,
+ * poly_core; the C++ wrapper in poly.hpp creates its own.
+ */
+struct poly_core_t {
+	volatile uint16_t	remain;	/*!< Samples remaining */
+	uint16_t		enable;	/*!< Enabled channels */
+	uint16_t		mute;	/*!< Muted channels */
+	uint16_t		modsrc;	/*!< Modulation source channels */
+	volatile uint8_t	shed;	/*!< Load shedding threshold */
+#ifdef _POLY_STATS
+	struct poly_stats_t*	stats;	/*!< Performance counters */
 #endif
+#ifdef _POLY_TRACE
+	struct poly_trace_ring_t*	trace;	/*!< Trace ring, or NULL */
+#endif
+};
+
+/*!
+ * The synthesizer instance driven by the C API.
+ */
+extern struct poly_core_t poly_core;
 
 /*!
  * Number of samples remaining before the next set of events.
  */
-extern volatile uint16_t poly_remain;
+#define poly_remain		(poly_core.remain)
+
+/*!
+ * Load shedding threshold.  Channels with a priority level above this
+ * are not mixed into the output; they continue to be stepped so they
+ * resume where they would have been when the threshold is raised again.
+ * Channels used as modulation sources are never shed; a muted channel
+ * that modulates nothing is silent anyway, so it is shed like any other.
+ * The front end lowers this when it falls behind, and raises it back to
+ * POLY_PRIO_LOWEST (the default) when there is headroom again.
+ */
+#define poly_shed		(poly_core.shed)
+
+#ifdef _POLY_NUM_CHANNELS
+#define POLY_STATE_CHANNELS	_POLY_NUM_CHANNELS
+#else
+#define POLY_STATE_CHANNELS	POLY_MAX_CHANNELS
+#endif
+
+/*!
+ * Synthesizer state snapshot.  This captures everything that determines
+ * the output of the synthesizer from a given point onwards.  Restoring
+ * a snapshot and loading the events that followed it reproduces the
+ * original output exactly.
+ */
+struct poly_state_t {
+	uint16_t	remain;	/*!< Samples remaining */
+	uint16_t	enable;	/*!< Enabled channels */
+	uint16_t	mute;	/*!< Muted channels */
+	/*! Voice channel states */
+	struct poly_voice_t	voice[POLY_STATE_CHANNELS];
+};
+
+/*!
+ * Keyframe: the synthesizer state immediately before a given event is
+ * loaded, and the number of samples emitted up to that point.
+ */
+struct poly_keyframe_t {
+	uint32_t	event;	/*!< Index of event following keyframe */
+	uint32_t	sample;	/*!< Sample offset of keyframe */
+	struct poly_state_t	state;	/*!< Synthesizer state */
+};
+
+#ifndef __AVR_ARCH__
+/*!
+ * One part of a block of samples split across threads with poly_split.
+ */
+struct poly_part_t {
+	uint16_t	voices;	/*!< Channels rendered by this part */
+	int16_t*	mix;	/*!< Partial mix buffer, set by the caller */
+#ifdef _POLY_STATS
+	struct poly_stats_t	stats;	/*!< Counters for this part */
+#endif
+};
+#endif
+
+/*!
+ * Output sample formats for poly_render.  Bits 2-0 give the number of
+ * bytes per sample; 16 and 32-bit samples are written in native byte
+ * order, 24-bit samples as three bytes, least significant first.
+ */
+#define POLY_OUT_WIDTH_MASK	(0x07)
+/*! Unsigned (offset binary) samples */
+#define POLY_OUT_UNSIGNED	(1 << 3)
+/*! Floating point samples */
+#define POLY_OUT_FLOAT		(1 << 4)
+
+#define POLY_OUT_S8		(1)
+#define POLY_OUT_U8		(1 | POLY_OUT_UNSIGNED)
+#define POLY_OUT_S16		(2)
+#define POLY_OUT_U16		(2 | POLY_OUT_UNSIGNED)
+#define POLY_OUT_S24		(3)
+#define POLY_OUT_U24		(3 | POLY_OUT_UNSIGNED)
+#define POLY_OUT_S32		(4)
+#define POLY_OUT_U32		(4 | POLY_OUT_UNSIGNED)
+#ifndef __AVR_ARCH__
+/*! 32-bit float, full scale at +/-1.0.  Not available on AVR. */
+#define POLY_OUT_F32		(4 | POLY_OUT_FLOAT)
+#endif
+
+/*!
+ * Gain shift limits.
+ */
+#define POLY_OUT_SHIFT_MIN	(-15)
+#define POLY_OUT_SHIFT_MAX	(16)
+
+/*!
+ * Output descriptor for poly_render.  Each output sample is the
+ * synthesizer sample shifted left by shift bits (right if negative),
+ * saturated to the range of the format.  For floating point, the
+ * shifted sample is divided by 32768 and not saturated.
+ */
+struct poly_out_t {
+	uint8_t		format;		/*!< Sample format, POLY_OUT_* */
+	int8_t		shift;		/*!< Gain shift */
+	uint8_t		channels;	/*!< Copies of each sample per frame */
+	uint16_t	stride;		/*!< Bytes per frame, 0 if packed */
+	/*!
+	 * Dither generator state.  If non-zero and shift is negative,
+	 * triangular dither of the bits shifted out is added to integer
+	 * samples, and this is updated as it runs.  Zero disables dither.
+	 */
+	uint16_t	dither;
+};
 
 /*!
  * Reset the polyphonic synthesizer.
@@ -240,11 +780,171 @@ void poly_reset();
  */
 int poly_load(const struct poly_evt_t* event);
 
+/*!
+ * Load a control event immediately, even part way through a segment.
+ * The change is heard from the next sample; the segment carries on
+ * for the samples it has left.  This is for live control, where the
+ * caller decides when events happen (see polyq.h); it must be called
+ * from the thread that renders.
+ * @param	event		Polyphonic event to load.
+ * @retval	0		Success
+ * @retval	-EINVAL		Bad event, or a TIME or END event
+ * @retval	-ERANGE		Bad value
+ */
+int poly_load_live(const struct poly_evt_t* event);
+
+/*!
+ * Load a group of events: everything up to and including the next TIME
+ * or END event, or the end of the array.  All events in the group are
+ * checked before any are loaded, so either the whole group takes effect
+ * or none of it does.
+ * @param	events		Polyphonic events to load.
+ * @param	count		Number of events available.
+ * @param	failed		If not NULL, receives the index of the
+ *				first bad event on failure.
+ * @returns	Number of events loaded, or a negative error code as per
+ *		poly_load.
+ */
+int poly_load_many(const struct poly_evt_t* const events, uint16_t count,
+		uint16_t* const failed);
+
 /*!
  * Retrieve the next output sample from the polyphonic synthesizer.
  */
 int16_t poly_next();
 
+/*!
+ * Render samples straight into an output buffer, converting them as
+ * described by the output descriptor.  Rendering stops at the end of
+ * the current segment, so fewer frames than asked for may be written.
+ * Each frame holds out->channels copies of the sample and starts
+ * out->stride bytes after the last; pass a stride that is a multiple
+ * of the frame size to write one channel of an interleaved buffer.
+ * @param	buffer		Buffer to write the first frame to.
+ * @param	count		Maximum number of frames to write.
+ * @param	out		Output descriptor.
+ * @returns	Number of frames written, or -EINVAL if the descriptor
+ *		is not valid.
+ */
+int poly_render(void* buffer, uint16_t count,
+		struct poly_out_t* const out);
+
+/*!
+ * Skip samples of the current segment without producing output,
+ * leaving the synthesizer exactly as if they had been retrieved with
+ * poly_next at the present load shedding level.  Most voices are
+ * advanced in one step regardless of the number of samples; only
+ * modulation sources, and the reduced-rate voices they modulate, cost
+ * time per sample skipped.
+ * @param	samples		Maximum number of samples to skip.
+ * @returns	Number of samples skipped, which is fewer than asked for
+ *		at the end of the segment.
+ */
+uint16_t poly_skip(uint16_t samples);
+
+#ifndef __AVR_ARCH__
+/*!
+ * Split the channels into parts that can be rendered on separate
+ * threads.  Channels connected by modulation routing go in the same
+ * part, and parts are balanced by the number of enabled channels.  The
+ * split is only valid until the next event is loaded.  The output
+ * descriptor is checked here, before anything is rendered, so that
+ * poly_join cannot then fail and leave the voices ahead of the
+ * synthesizer.
+ * @param	part		Parts to fill in; the mix buffers are left
+ *				alone.
+ * @param	num_parts	Maximum number of parts, at most
+ *				POLY_MAX_CHANNELS are used.
+ * @param	out		Output descriptor the block will be joined
+ *				with.
+ * @returns	Number of parts used, to pass to poly_join, or -EINVAL
+ *		if the descriptor is not valid.
+ */
+int poly_split(struct poly_part_t* const part, uint8_t num_parts,
+		const struct poly_out_t* const out);
+
+/*!
+ * Render the next samples of a part's channels into its mix buffer,
+ * without advancing the synthesizer.  Different parts from the same
+ * split may be rendered at the same time on different threads.  Only
+ * the parts' counters are updated, and no ramp or clip trace records
+ * are written.
+ * @param	part		Part to render.
+ * @param	count		Number of samples; at most poly_remain.
+ */
+void poly_part_render(struct poly_part_t* const part, uint16_t count);
+
+/*!
+ * Finish a block rendered with poly_part_render.  The partial mixes
+ * are added up, giving exactly the samples poly_render would have, and
+ * converted into the output buffer.  The synthesizer then advances
+ * past them and the parts' counters are added to poly_stats.  Call this
+ * once every part has been rendered, from one thread.
+ * @param	part		Parts rendered; the first part's mix buffer
+ *				is overwritten.
+ * @param	num_parts	Number of parts, as returned by poly_split.
+ * @param	buffer		Buffer to write the first frame to.
+ * @param	count		Number of samples rendered in each part.
+ * @param	out		Output descriptor.
+ * @returns	Number of frames written, or -EINVAL if the descriptor
+ *		is not valid or there are more than POLY_MAX_CHANNELS
+ *		parts.
+ */
+int poly_join(struct poly_part_t* const part, uint8_t num_parts,
+		void* buffer, uint16_t count, struct poly_out_t* const out);
+#endif
+
+#ifdef _POLY_STATS
+/*!
+ * Reset the performance counters.
+ */
+void poly_stats_reset();
+
+#ifndef __AVR_ARCH__
+/*!
+ * Record the time taken to render a block of samples.
+ * @param	usec		Render time in microseconds.
+ */
+void poly_stats_block(uint32_t usec);
+#endif
+#endif
+
+/*!
+ * Take a snapshot of the synthesizer state.
+ * @param	state		State structure to write to.
+ */
+void poly_snapshot(struct poly_state_t* const state);
+
+/*!
+ * Restore the synthesizer state from a snapshot.
+ * @param	state		State structure to read from.
+ */
+void poly_restore(const struct poly_state_t* const state);
+
+/*!
+ * Scan through a sequence of events, recording keyframes at the event
+ * boundaries nominated in the keyframe array.  The events are played
+ * from the current synthesizer state as a player would: each event is
+ * loaded in turn and all samples of each TIME event are emitted before
+ * the next event is loaded.  No audio is produced, and only those
+ * voices whose output feeds another voice are fully computed.  The
+ * synthesizer state is left unchanged.
+ *
+ * The caller sets the event field of each keyframe; keyframes must be
+ * sorted by event index.  An event index equal to num_events records
+ * the state at the end of the sequence.
+ *
+ * @param	events		Events to scan.
+ * @param	num_events	Number of events to scan.
+ * @param	keyframes	Keyframes to record.
+ * @param	num_keyframes	Number of keyframes.
+ * @returns	Number of keyframes recorded, or a negative error code
+ *		from poly_load.
+ */
+int poly_scan(const struct poly_evt_t* const events, uint32_t num_events,
+		struct poly_keyframe_t* const keyframes,
+		uint16_t num_keyframes);
+
 /*
  * vim: set sw=8 ts=8 noet si tw=72
  */
@@ -0,0 +1,263 @@
+#ifndef _POLY_HPP
+#define _POLY_HPP
+
+/*!
+ * Polyphonic synthesizer for microcontrollers: C++ interface.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+extern "C" {
+#include "poly_core.h"
+}
+
+namespace poly {
+
+/*!
+ * Polyphonic synthesizer instance.  This is the same engine as the C
+ * API, but the number of channels and sample rate are compile-time
+ * constants, so the compiler folds the sample rate division and can
+ * unroll the channel loops.  Each instance owns its own voice storage,
+ * so any number of differently configured synthesizers may coexist.
+ * Instances may be moved but not copied; use snapshot() and restore()
+ * to duplicate state.  Snapshots are limited to POLY_STATE_CHANNELS,
+ * which is smaller if the C engine is built with _POLY_NUM_CHANNELS.
+ *
+ * No poly.c is needed: this header is all there is.
+ */
+template <uint8_t Channels, uint16_t SampleRate>
+class Synth {
+	static_assert((Channels > 0) && (Channels <= POLY_MAX_CHANNELS),
+			"Channels must be between 1 and POLY_MAX_CHANNELS");
+	static_assert(SampleRate >= 2, "SampleRate is too low");
+
+	public:
+		/*! Number of voice channels */
+		static constexpr uint8_t num_channels = Channels;
+		/*! Sample rate */
+		static constexpr uint16_t freq = SampleRate;
+		/*! Maximum frequency (nyquist frequency) */
+		static constexpr uint16_t freq_max = SampleRate / 2;
+
+		Synth() : voice(new poly_voice_t[Channels]()), core() {
+			core.shed = POLY_PRIO_LOWEST;
+#ifdef _POLY_STATS
+			core.stats = &stats_;
+			stats_ = poly_stats_t();
+			stats_.fifo_min = UINT8_MAX;
+#endif
+			reset();
+		}
+
+		Synth(Synth&& other) noexcept :
+			voice(std::move(other.voice)), core(other.core)
+#ifdef _POLY_STATS
+			, stats_(other.stats_)
+#endif
+		{
+#ifdef _POLY_STATS
+			core.stats = &stats_;
+#endif
+		}
+
+		Synth& operator=(Synth&& other) noexcept {
+			voice = std::move(other.voice);
+			core = other.core;
+#ifdef _POLY_STATS
+			stats_ = other.stats_;
+			core.stats = &stats_;
+#endif
+			return *this;
+		}
+
+		Synth(const Synth&) = delete;
+		Synth& operator=(const Synth&) = delete;
+
+		/*!
+		 * Reset the synthesizer.
+		 */
+		void reset() {
+			poly_core_reset(&core, cfg());
+		}
+
+		/*!
+		 * Load an event.  See poly_load.
+		 */
+		int load(const poly_evt_t& event) {
+			return poly_core_load(&core, cfg(), &event);
+		}
+
+		/*!
+		 * Load a control event mid-segment.  See poly_load_live.
+		 */
+		int load_live(const poly_evt_t& event) {
+			return poly_core_load_live(&core, cfg(), &event);
+		}
+
+		/*!
+		 * Load a group of events.  See poly_load_many.
+		 */
+		int load_many(const poly_evt_t* events, uint16_t count,
+				uint16_t* failed = nullptr) {
+			return poly_core_load_many(&core, cfg(),
+					events, count, failed);
+		}
+
+		/*!
+		 * Retrieve the next output sample.  See poly_next.
+		 */
+		int16_t next() {
+			return poly_core_next(&core, cfg());
+		}
+
+		/*!
+		 * Render up to count samples of the current segment.
+		 * @returns	Number of samples written.
+		 */
+		std::size_t render(int16_t* out, std::size_t count) {
+			std::size_t done = 0;
+			while (core.remain && (done < count))
+				out[done++] = poly_core_next(&core, cfg());
+			return done;
+		}
+
+		/*!
+		 * Skip up to count samples of the current segment.  See
+		 * poly_skip.
+		 * @returns	Number of samples skipped.
+		 */
+		uint16_t skip(uint16_t count) {
+			return poly_core_skip(&core, cfg(), count);
+		}
+
+		/*!
+		 * Render up to count frames of the current segment,
+		 * converting them as described by out.  See poly_render.
+		 */
+		int render(void* buffer, uint16_t count, poly_out_t& out) {
+			return poly_core_render(&core, cfg(), buffer,
+					count, &out);
+		}
+
+		/*!
+		 * Number of samples remaining before the next set of
+		 * events.
+		 */
+		uint16_t remain() const {
+			return core.remain;
+		}
+
+		/*!
+		 * Load shedding threshold.  See poly_shed.
+		 */
+		uint8_t shed() const {
+			return core.shed;
+		}
+
+		void shed(uint8_t prio) {
+			core.shed = prio;
+		}
+
+		/*!
+		 * Read-only access to a voice channel.
+		 */
+		const poly_voice_t& operator[](uint8_t vid) const {
+			return voice[vid];
+		}
+
+		/*!
+		 * Take a snapshot of the synthesizer state.
+		 */
+		void snapshot(poly_state_t& state) const {
+			static_assert(Channels <= POLY_STATE_CHANNELS,
+				"Channels does not fit in poly_state_t");
+			poly_core_snapshot(&core, cfg(), &state);
+		}
+
+		/*!
+		 * Restore the synthesizer state from a snapshot.
+		 */
+		void restore(const poly_state_t& state) {
+			static_assert(Channels <= POLY_STATE_CHANNELS,
+				"Channels does not fit in poly_state_t");
+			poly_core_restore(&core, cfg(), &state);
+		}
+
+		/*!
+		 * Scan events, recording keyframes.  See poly_scan.
+		 */
+		int scan(const poly_evt_t* events, uint32_t num_events,
+				poly_keyframe_t* keyframes,
+				uint16_t num_keyframes) {
+			static_assert(Channels <= POLY_STATE_CHANNELS,
+				"Channels does not fit in poly_state_t");
+			return poly_core_scan(&core, cfg(), events,
+					num_events, keyframes,
+					num_keyframes);
+		}
+
+#ifdef _POLY_STATS
+		/*!
+		 * Performance counters for this instance.
+		 */
+		const poly_stats_t& stats() const {
+			return stats_;
+		}
+#endif
+
+#ifdef _POLY_TRACE
+		/*!
+		 * Record this instance's activity in a trace ring, or
+		 * stop tracing with nullptr.  Instances are not traced
+		 * unless given a ring.
+		 */
+		void trace(poly_trace_ring_t* ring) {
+			core.trace = ring;
+		}
+#endif
+
+	private:
+		/*!
+		 * Engine configuration.  Only the voice pointer is not
+		 * a compile-time constant.
+		 */
+		poly_cfg_t cfg() const {
+			poly_cfg_t cfg = {
+				voice.get(), Channels,
+				SampleRate, freq_max
+			};
+			return cfg;
+		}
+
+		std::unique_ptr<poly_voice_t[]>	voice;
+		poly_core_t			core;
+#ifdef _POLY_STATS
+		poly_stats_t			stats_;
+#endif
+};
+
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
+
+#endif
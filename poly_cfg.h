@@ -24,4 +24,18 @@
 #define _POLY_NUM_CHANNELS	16
 #define _POLY_FREQ		32000
 
+/*
+ * To fit more channels or a larger FIFO in SRAM, features can be left
+ * out and the voice structure packed; see README.md.  Reduced-rate
+ * evaluation and PCM sample playback are left out by default, keeping
+ * each voice at 16 bytes.
+ */
+/* #define _POLY_PACKED */
+#define _POLY_NO_RATE
+#define _POLY_NO_PCM
+
+/* Trace into a RAM ring for debugging; see README.md. */
+/* #define _POLY_TRACE */
+/* #define _POLY_TRACE_SZ	32 */
+
 #endif
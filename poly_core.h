@@ -0,0 +1,1552 @@
+#ifndef _POLY_CORE_H
+#define _POLY_CORE_H
+
+/*!
+ * Polyphonic synthesizer for microcontrollers: synthesis engine.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/*
+ * The engine is written as inline functions operating on a synthesizer
+ * instance (struct poly_core_t) and its configuration (struct
+ * poly_cfg_t).  The configuration is passed by value so that when it is
+ * made of constants (_POLY_NUM_CHANNELS and _POLY_FREQ in C, or the
+ * template parameters of poly::Synth in C++), the compiler can fold the
+ * sample rate divisions and channel loop bounds.
+ *
+ * poly.c builds the C API on a single global instance; poly.hpp builds a
+ * C++ class on it.  Applications should use one of those.
+ */
+
+#include "poly.h"
+#include <string.h>
+#include <assert.h>
+
+#ifdef __AVR_ARCH__
+#include <avr/pgmspace.h>
+#ifdef _POLY_TRACE
+#include <util/atomic.h>
+#endif
+#endif
+
+#ifdef _DEBUG
+#include <stdio.h>
+#define _DPRINTF(s, a...)	printf(__FILE__ ": %d " s, __LINE__, a)
+#else
+#define _DPRINTF(s, a...)
+#endif
+
+#ifdef _POLY_STATS
+#define _POLY_CORE_STATS_INC(core, field)	((core)->stats->field++)
+#else
+#define _POLY_CORE_STATS_INC(core, field)	((void)(core))
+#endif
+
+#ifdef _POLY_TRACE
+/*!
+ * Write a record to a trace ring.  On AVR, interrupts are held off
+ * while the record is written, as an ISR may be tracing too.
+ */
+static inline void poly_trace_write(struct poly_trace_ring_t* const ring,
+		uint16_t time, uint8_t type, uint8_t arg, uint16_t value) {
+#ifdef __AVR_ARCH__
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+#endif
+	{
+		struct poly_trace_t* const rec = &ring->rec[
+			ring->head & (_POLY_TRACE_SZ - 1)];
+		rec->time = time;
+		rec->type = type;
+		rec->arg = arg;
+		rec->value = value;
+		ring->head++;
+	}
+}
+
+/*!
+ * Add a record to a trace ring at the current sample clock, if its
+ * type is enabled.
+ */
+static inline void poly_trace_put(struct poly_trace_ring_t* const ring,
+		uint8_t type, uint8_t arg, uint16_t value) {
+	if (ring->mask & (1U << type))
+		poly_trace_write(ring, ring->clock, type, arg, value);
+}
+
+/*!
+ * Advance the sample clock of an instance's trace ring.  Each time its
+ * low 16 bits wrap, a WRAP record is written regardless of the mask, so
+ * the decoder can keep count.
+ */
+static inline void poly_core_trace_clock(struct poly_core_t* const core,
+		uint16_t samples) {
+	struct poly_trace_ring_t* const ring = core->trace;
+	if (!ring)
+		return;
+	const uint32_t last = ring->clock;
+	ring->clock += samples;
+	if ((last ^ ring->clock) >> 16)
+		poly_trace_write(ring, 0, POLY_TRACE_WRAP, 0,
+				ring->clock >> 16);
+}
+
+#define _POLY_CORE_TRACE(core, type, arg, value)	do {		\
+		if ((core)->trace)					\
+			poly_trace_put((core)->trace, (type),		\
+					(arg), (value));		\
+	} while (0)
+#define _POLY_CORE_TRACE_CLOCK(core, samples)			\
+	poly_core_trace_clock((core), (samples))
+#else
+#define _POLY_CORE_TRACE(core, type, arg, value)	((void)(core))
+#define _POLY_CORE_TRACE_CLOCK(core, samples)		((void)(core))
+#endif
+
+#define POLY_SINE_SZ 360
+
+/* Voice rate divider register: divider - 1 and interpolation flag */
+#define POLY_RDIV_MASK		(0x7f)
+#define POLY_RDIV_INTERP	(0x80)
+
+static const uint8_t _poly_sine[POLY_SINE_SZ]
+#ifdef __AVR_ARCH__
+PROGMEM
+#endif
+= {
+
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x0A,
+	0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x14, 0x15,
+	0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1F, 0x20,
+	0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x2A, 0x2B,
+	0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0x35, 0x36,
+	0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x40,
+	0x41, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B,
+	0x4C, 0x4D, 0x4E, 0x4F, 0x50, 0x51, 0x53, 0x54, 0x55, 0x56,
+	0x57, 0x58, 0x59, 0x5A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F, 0x60,
+	0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A,
+	0x6B, 0x6C, 0x6D, 0x6E, 0x6F, 0x70, 0x71, 0x72, 0x73, 0x74,
+	0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7E,
+	0x7F, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88,
+	0x89, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F, 0x90, 0x91,
+	0x92, 0x93, 0x94, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A,
+	0x9B, 0x9C, 0x9C, 0x9D, 0x9E, 0x9F, 0xA0, 0xA1, 0xA2, 0xA3,
+	0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA8, 0xA9, 0xAA, 0xAB,
+	0xAC, 0xAD, 0xAD, 0xAE, 0xAF, 0xB0, 0xB1, 0xB1, 0xB2, 0xB3,
+	0xB4, 0xB5, 0xB5, 0xB6, 0xB7, 0xB8, 0xB8, 0xB9, 0xBA, 0xBB,
+	0xBC, 0xBC, 0xBD, 0xBE, 0xBE, 0xBF, 0xC0, 0xC1, 0xC1, 0xC2,
+	0xC3, 0xC4, 0xC4, 0xC5, 0xC6, 0xC6, 0xC7, 0xC8, 0xC8, 0xC9,
+	0xCA, 0xCA, 0xCB, 0xCC, 0xCC, 0xCD, 0xCE, 0xCE, 0xCF, 0xD0,
+	0xD0, 0xD1, 0xD2, 0xD2, 0xD3, 0xD4, 0xD4, 0xD5, 0xD5, 0xD6,
+	0xD7, 0xD7, 0xD8, 0xD8, 0xD9, 0xDA, 0xDA, 0xDB, 0xDB, 0xDC,
+	0xDC, 0xDD, 0xDD, 0xDE, 0xDF, 0xDF, 0xE0, 0xE0, 0xE1, 0xE1,
+	0xE2, 0xE2, 0xE3, 0xE3, 0xE4, 0xE4, 0xE5, 0xE5, 0xE6, 0xE6,
+	0xE7, 0xE7, 0xE8, 0xE8, 0xE8, 0xE9, 0xE9, 0xEA, 0xEA, 0xEB,
+	0xEB, 0xEC, 0xEC, 0xEC, 0xED, 0xED, 0xEE, 0xEE, 0xEE, 0xEF,
+	0xEF, 0xEF, 0xF0, 0xF0, 0xF1, 0xF1, 0xF1, 0xF2, 0xF2, 0xF2,
+	0xF3, 0xF3, 0xF3, 0xF4, 0xF4, 0xF4, 0xF5, 0xF5, 0xF5, 0xF6,
+	0xF6, 0xF6, 0xF6, 0xF7, 0xF7, 0xF7, 0xF7, 0xF8, 0xF8, 0xF8,
+	0xF8, 0xF9, 0xF9, 0xF9, 0xF9, 0xFA, 0xFA, 0xFA, 0xFA, 0xFA,
+	0xFB, 0xFB, 0xFB, 0xFB, 0xFB, 0xFC, 0xFC, 0xFC, 0xFC, 0xFC,
+	0xFC, 0xFC, 0xFD, 0xFD, 0xFD, 0xFD, 0xFD, 0xFD, 0xFD, 0xFD,
+	0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE,
+	0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE, 0xFE,
+
+};
+
+/*!
+ * No modulation: value returned by poly_voice_pmod and poly_voice_amod.
+ */
+#define POLY_MOD_NONE		(-1)
+
+#if defined(_POLY_NO_MOD)
+static inline int8_t poly_voice_pmod(
+		const struct poly_voice_t* const voice) {
+	(void)voice;
+	return POLY_MOD_NONE;
+}
+
+static inline int8_t poly_voice_amod(
+		const struct poly_voice_t* const voice) {
+	(void)voice;
+	return POLY_MOD_NONE;
+}
+#elif defined(_POLY_PACKED)
+/*!
+ * Read a modulation field of the routing register.
+ */
+static inline int8_t poly_voice_route_mod(
+		const struct poly_voice_t* const voice, uint8_t bit) {
+	uint8_t field = (voice->route >> bit) & POLY_ROUTE_FIELD_MASK;
+	if (!(field & POLY_ROUTE_MOD_EN))
+		return POLY_MOD_NONE;
+	return field & 0x0f;
+}
+
+/*!
+ * Write a field of the routing register.
+ */
+static inline void poly_voice_route_set(struct poly_voice_t* const voice,
+		uint8_t bit, uint8_t field) {
+	voice->route = (voice->route
+			& ~(POLY_ROUTE_FIELD_MASK << bit))
+		| ((uint16_t)field << bit);
+}
+
+static inline int8_t poly_voice_pmod(
+		const struct poly_voice_t* const voice) {
+	return poly_voice_route_mod(voice, POLY_ROUTE_PMOD_BIT);
+}
+
+static inline int8_t poly_voice_amod(
+		const struct poly_voice_t* const voice) {
+	return poly_voice_route_mod(voice, POLY_ROUTE_AMOD_BIT);
+}
+
+static inline void poly_voice_set_pmod(struct poly_voice_t* const voice,
+		int8_t vid) {
+	poly_voice_route_set(voice, POLY_ROUTE_PMOD_BIT,
+			(vid < 0) ? 0 : (vid | POLY_ROUTE_MOD_EN));
+}
+
+static inline void poly_voice_set_amod(struct poly_voice_t* const voice,
+		int8_t vid) {
+	poly_voice_route_set(voice, POLY_ROUTE_AMOD_BIT,
+			(vid < 0) ? 0 : (vid | POLY_ROUTE_MOD_EN));
+}
+
+static inline uint8_t poly_voice_ascale(
+		const struct poly_voice_t* const voice) {
+	return (voice->route >> POLY_ROUTE_ASCALE_BIT)
+		& POLY_ROUTE_FIELD_MASK;
+}
+
+static inline void poly_voice_set_ascale(struct poly_voice_t* const voice,
+		uint8_t ascale) {
+	poly_voice_route_set(voice, POLY_ROUTE_ASCALE_BIT, ascale);
+}
+#else
+/*
+ * Unpacked layout: modulation channels are stored with bit 7 set if
+ * enabled.
+ */
+static inline int8_t poly_voice_pmod(
+		const struct poly_voice_t* const voice) {
+	return voice->pmod ? (voice->pmod & 0x0f) : POLY_MOD_NONE;
+}
+
+static inline int8_t poly_voice_amod(
+		const struct poly_voice_t* const voice) {
+	return voice->amod ? (voice->amod & 0x0f) : POLY_MOD_NONE;
+}
+
+static inline void poly_voice_set_pmod(struct poly_voice_t* const voice,
+		int8_t vid) {
+	voice->pmod = (vid < 0) ? 0 : (vid | 0x80);
+}
+
+static inline void poly_voice_set_amod(struct poly_voice_t* const voice,
+		int8_t vid) {
+	voice->amod = (vid < 0) ? 0 : (vid | 0x80);
+}
+#endif
+
+#if !defined(_POLY_PACKED) || defined(_POLY_NO_MOD)
+static inline uint8_t poly_voice_ascale(
+		const struct poly_voice_t* const voice) {
+	return voice->ascale;
+}
+
+static inline void poly_voice_set_ascale(struct poly_voice_t* const voice,
+		uint8_t ascale) {
+	voice->ascale = ascale;
+}
+#endif
+
+/*!
+ * Recompute the set of channels used as modulation sources.
+ */
+static inline void poly_core_update_modsrc(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg) {
+	uint8_t vid;
+	core->modsrc = 0;
+	for (vid = 0; vid < cfg.num_channels; vid++) {
+		int8_t src = poly_voice_pmod(&cfg.voice[vid]);
+		if (src >= 0)
+			core->modsrc |= 1U << src;
+		src = poly_voice_amod(&cfg.voice[vid]);
+		if (src >= 0)
+			core->modsrc |= 1U << src;
+	}
+}
+
+/*!
+ * Reset the polyphonic synthesizer.
+ */
+static inline void poly_core_reset(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg) {
+	memset(cfg.voice, 0,
+			sizeof(struct poly_voice_t)*cfg.num_channels);
+	core->remain = 0;
+	core->modsrc = 0;
+}
+
+/*!
+ * Check that an event may be loaded.
+ * @param	event	Polyphonic event to check.
+ * @param	remain	Samples remaining at the time the event is loaded.
+ * @retval	0		Event may be loaded
+ * @retval	-EINVAL		Bad event
+ * @retval	-ERANGE		Bad value
+ * @retval	-EINPROGRESS	Waiting for timing event
+ */
+static inline int poly_core_check(const struct poly_cfg_t cfg,
+		const struct poly_evt_t* const event, uint16_t remain) {
+	uint16_t type = (event->flags) & POLY_EVT_TYPE_MASK;
+	switch (type) {
+		case POLY_EVT_TYPE_TIME:
+		case POLY_EVT_TYPE_END:
+			return 0;
+	}
+
+	/* Forbid updating of voice states while we are waiting! */
+	if (remain)
+		return -EINPROGRESS;
+
+	switch (type) {
+		case POLY_EVT_TYPE_ENABLE:
+		case POLY_EVT_TYPE_MUTE:
+			return 0;
+	}
+
+	if (((event->flags >> POLY_CH_BIT) & 0x0f) >= cfg.num_channels)
+		return -EINVAL;
+
+	switch (type) {
+		case POLY_EVT_TYPE_IFREQ:
+		case POLY_EVT_TYPE_IAMP:
+#ifndef _POLY_NO_RAMP
+		case POLY_EVT_TYPE_DFREQ:
+		case POLY_EVT_TYPE_DAMP:
+		case POLY_EVT_TYPE_DSCALE:
+#endif
+			return 0;
+		case POLY_EVT_TYPE_PRIO:
+			if (event->value > POLY_PRIO_LOWEST)
+				return -ERANGE;
+			return 0;
+#ifndef _POLY_NO_MOD
+		case POLY_EVT_TYPE_PMOD:
+		case POLY_EVT_TYPE_AMOD:
+			if ((event->value != UINT16_MAX)
+					&& (event->value >= cfg.num_channels))
+				return -ERANGE;
+			return 0;
+#endif
+		case POLY_EVT_TYPE_ASCALE:
+			if (event->value > 31)
+				return -ERANGE;
+			return 0;
+#ifndef _POLY_NO_RATE
+		case POLY_EVT_TYPE_RATE:
+			if ((event->value & ~POLY_RATE_INTERP)
+					> POLY_RATE_DIV_MAX)
+				return -ERANGE;
+			return 0;
+#endif
+		case POLY_EVT_TYPE_WAVE:
+			if (event->value < POLY_WAVE_TABLE(0))
+				return 0;
+			if (!&poly_num_wavetables
+					|| (event->value >= POLY_WAVE_TABLE(
+						poly_num_wavetables))
+					|| (event->value > POLY_WAVE_MASK))
+				return -ERANGE;
+			return 0;
+#ifndef _POLY_NO_PCM
+		case POLY_EVT_TYPE_PCM:
+			if (!&poly_num_pcm
+					|| (event->value >= poly_num_pcm)
+					|| (event->value >= POLY_PCM_SAMPLES))
+				return -ERANGE;
+			return 0;
+#endif
+	}
+
+	/* If we get here, then it was a bad event */
+	return -EINVAL;
+}
+
+/*!
+ * Apply an event that has passed poly_core_check to the polyphonic
+ * registers.
+ * @param	event	Polyphonic event to apply.
+ */
+static inline void poly_core_apply(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg,
+		const struct poly_evt_t* const event) {
+	struct poly_voice_t* const voice = &cfg.voice[
+		(event->flags >> POLY_CH_BIT) & 0x0f];
+	_POLY_CORE_TRACE(core, POLY_TRACE_EVENT, event->flags >> 8,
+			event->value);
+	switch ((event->flags) & POLY_EVT_TYPE_MASK) {
+		case POLY_EVT_TYPE_TIME:
+			core->remain = event->value;
+			break;
+		case POLY_EVT_TYPE_END:
+			poly_core_reset(core, cfg);
+			break;
+		case POLY_EVT_TYPE_ENABLE:
+			core->enable = event->value;
+			break;
+		case POLY_EVT_TYPE_MUTE:
+			core->mute = event->value;
+			break;
+		case POLY_EVT_TYPE_IFREQ:
+			voice->freq = event->value;
+			voice->time = 0;
+#ifndef _POLY_NO_PCM
+			voice->pos = 0;
+#endif
+			break;
+#ifndef _POLY_NO_RAMP
+		case POLY_EVT_TYPE_DFREQ:
+			voice->dfreq = event->value;
+			break;
+#endif
+		case POLY_EVT_TYPE_PRIO:
+			voice->flags = (voice->flags & ~POLY_PRIO_MASK)
+				| (event->value << POLY_PRIO_BIT);
+			break;
+#ifndef _POLY_NO_MOD
+		case POLY_EVT_TYPE_PMOD:
+			poly_voice_set_pmod(voice,
+					(event->value == UINT16_MAX)
+					? POLY_MOD_NONE : event->value);
+			poly_core_update_modsrc(core, cfg);
+			break;
+#endif
+		case POLY_EVT_TYPE_IAMP:
+			voice->amp = event->value;
+			break;
+#ifndef _POLY_NO_RAMP
+		case POLY_EVT_TYPE_DAMP:
+			voice->damp = event->value;
+			break;
+		case POLY_EVT_TYPE_DSCALE:
+			voice->dscale = event->value;
+			break;
+#endif
+#ifndef _POLY_NO_MOD
+		case POLY_EVT_TYPE_AMOD:
+			poly_voice_set_amod(voice,
+					(event->value == UINT16_MAX)
+					? POLY_MOD_NONE : event->value);
+			poly_core_update_modsrc(core, cfg);
+			break;
+#endif
+		case POLY_EVT_TYPE_ASCALE:
+			poly_voice_set_ascale(voice, event->value);
+			break;
+		case POLY_EVT_TYPE_WAVE:
+			voice->flags = (voice->flags
+					& ~(POLY_WAVE_MASK | POLY_PCM))
+				| event->value;
+			break;
+#ifndef _POLY_NO_PCM
+		case POLY_EVT_TYPE_PCM:
+			voice->flags = (voice->flags & ~POLY_WAVE_MASK)
+				| POLY_PCM | event->value;
+			break;
+#endif
+#ifndef _POLY_NO_RATE
+		case POLY_EVT_TYPE_RATE:
+			voice->rdiv = event->value & 0xff;
+			if (voice->rdiv)
+				voice->rdiv--;
+			if (event->value & POLY_RATE_INTERP)
+				voice->rdiv |= POLY_RDIV_INTERP;
+			voice->rcnt = 0;
+			voice->rstep = 0;
+			break;
+#endif
+	}
+}
+
+/*!
+ * Count a rejected event.
+ */
+static inline void poly_core_reject(struct poly_core_t* const core,
+		const struct poly_evt_t* const event, int res) {
+	_POLY_CORE_TRACE(core, POLY_TRACE_REJECT, event->flags >> 8, -res);
+	(void)event;
+	switch (res) {
+		case -EINVAL:
+			_POLY_CORE_STATS_INC(core, einval);
+			break;
+		case -ERANGE:
+			_POLY_CORE_STATS_INC(core, erange);
+			break;
+		case -EINPROGRESS:
+			_POLY_CORE_STATS_INC(core, einprogress);
+			break;
+	}
+}
+
+/*!
+ * Load a sample event into the polyphonic registers.
+ * @param	event	Polyphonic event to load.
+ */
+static inline int poly_core_load(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg,
+		const struct poly_evt_t* const event) {
+	int res = poly_core_check(cfg, event, core->remain);
+	if (res < 0) {
+		poly_core_reject(core, event, res);
+		return res;
+	}
+	poly_core_apply(core, cfg, event);
+	return 0;
+}
+
+/*!
+ * Load a control event part way through a segment.  The segment
+ * carries on; timing events are refused, as they would cut it short.
+ */
+static inline int poly_core_load_live(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg,
+		const struct poly_evt_t* const event) {
+	int res;
+	switch (event->flags & POLY_EVT_TYPE_MASK) {
+		case POLY_EVT_TYPE_TIME:
+		case POLY_EVT_TYPE_END:
+			res = -EINVAL;
+			break;
+		default:
+			res = poly_core_check(cfg, event, 0);
+	}
+	if (res < 0) {
+		poly_core_reject(core, event, res);
+		return res;
+	}
+	poly_core_apply(core, cfg, event);
+	return 0;
+}
+
+/*!
+ * Load a group of events, up to and including the next TIME or END.
+ */
+static inline int poly_core_load_many(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg,
+		const struct poly_evt_t* const events, uint16_t count,
+		uint16_t* const failed) {
+	uint16_t remain = core->remain;
+	uint16_t num = 0;
+	uint16_t evt;
+
+	/* Validate the whole group before touching anything */
+	while (num < count) {
+		uint16_t type = events[num].flags & POLY_EVT_TYPE_MASK;
+		int res = poly_core_check(cfg, &events[num], remain);
+		if (res < 0) {
+			poly_core_reject(core, &events[num], res);
+			if (failed)
+				*failed = num;
+			return res;
+		}
+		num++;
+		if ((type == POLY_EVT_TYPE_TIME)
+				|| (type == POLY_EVT_TYPE_END))
+			break;
+	}
+
+	for (evt = 0; evt < num; evt++)
+		poly_core_apply(core, cfg, &events[evt]);
+	return num;
+}
+
+/*!
+ * Emit the sinusoid at the given fixed-point angle in ¼ degrees.
+ */
+static inline int16_t poly_sine(uint16_t angle) {
+	int16_t amp = 1;
+	angle %= (POLY_SINE_SZ*4);
+	if (angle >= (POLY_SINE_SZ*2)) {
+		amp = -1;
+		angle = (POLY_SINE_SZ*4) - angle - 1;
+	}
+	if (angle >= POLY_SINE_SZ)
+		angle = (POLY_SINE_SZ*2) - angle - 1;
+
+	assert(angle < POLY_SINE_SZ);
+	return amp *
+#ifdef __AVR_ARCH__
+		pgm_read_byte(&_poly_sine[angle])
+#else
+		_poly_sine[angle]
+#endif
+		;
+}
+
+/*!
+ * Emit the given waveform at the given fixed-point angle in ¼ degrees.
+ */
+static inline int16_t poly_wave(uint8_t wave, uint16_t angle) {
+	const int8_t* table;
+
+	angle %= (POLY_SINE_SZ*4);
+	switch (wave) {
+		case POLY_WAVE_SINE:
+			return poly_sine(angle);
+		case POLY_WAVE_SQUARE:
+			return (angle < (POLY_SINE_SZ*2)) ? 254 : -254;
+		case POLY_WAVE_SAW:
+			return (int16_t)(((uint32_t)angle * 91) >> 8) - 256;
+		case POLY_WAVE_TRIANGLE:
+			if (angle >= (POLY_SINE_SZ*2))
+				angle = (POLY_SINE_SZ*4) - angle - 1;
+			return (int16_t)(((uint32_t)angle * 91) >> 7) - 256;
+	}
+
+#ifdef __AVR_ARCH__
+	table = (const int8_t*)pgm_read_word(
+			&poly_wavetable[wave - POLY_WAVE_TABLE(0)]);
+	return 2 * (int8_t)pgm_read_byte(&table[angle >> 2]);
+#else
+	table = poly_wavetable[wave - POLY_WAVE_TABLE(0)];
+	return 2 * table[angle >> 2];
+#endif
+}
+
+#ifndef _POLY_NO_PCM
+/*!
+ * Move a PCM voice's position on by count samples at its current rate.
+ * The fraction of a sample carried between steps is time * rate mod
+ * 256, so while the rate holds the position is exactly time * rate / 256
+ * from IFREQ, however often time wraps.  A sample played once stops at
+ * its end; a looped one folds back into its loop.
+ */
+static inline void poly_pcm_advance(struct poly_voice_t* const voice,
+		uint16_t count) {
+	const struct poly_pcm_t* const pcm =
+		&poly_pcm[voice->flags & POLY_WAVE_MASK];
+#ifdef __AVR_ARCH__
+	const uint16_t len = pgm_read_word(&pcm->len);
+	const uint16_t loop = pgm_read_word(&pcm->loop);
+#else
+	const uint16_t len = pcm->len;
+	const uint16_t loop = pcm->loop;
+#endif
+	const uint8_t frac = (uint8_t)voice->time * (uint8_t)voice->freq;
+	uint32_t pos = voice->pos
+		+ ((frac + (uint32_t)count * voice->freq) >> 8);
+
+	if (pos >= len) {
+		if (loop >= len)
+			pos = len;
+		else
+			pos = loop + ((pos - loop) % (len - loop));
+	}
+	voice->pos = pos;
+}
+
+/*!
+ * Fetch a PCM sample at a voice's position plus an offset, following
+ * its loop.  Returns a value scaled to 16 bits, or 0 outside the sample
+ * or once a sample played once has ended.
+ */
+static inline int16_t poly_pcm_sample(uint8_t index, uint16_t base,
+		int16_t offset) {
+	const struct poly_pcm_t* const pcm = &poly_pcm[index];
+#ifdef __AVR_ARCH__
+	const void* const data = (const void*)pgm_read_word(&pcm->data);
+	const uint16_t len = pgm_read_word(&pcm->len);
+	const uint16_t loop = pgm_read_word(&pcm->loop);
+	const uint8_t format = pgm_read_byte(&pcm->format);
+#else
+	const void* const data = pcm->data;
+	const uint16_t len = pcm->len;
+	const uint16_t loop = pcm->loop;
+	const uint8_t format = pcm->format;
+#endif
+	int32_t pos = (int32_t)base + offset;
+
+	if ((base >= len) || (pos < 0))
+		return 0;
+	if (pos >= len) {
+		if (loop >= len)
+			return 0;
+		pos = loop + ((pos - loop) % (len - loop));
+	}
+
+#ifdef __AVR_ARCH__
+	if (format == POLY_PCM_S16)
+		return pgm_read_word(&((const int16_t*)data)[pos]);
+	return 256 * (int8_t)pgm_read_byte(&((const int8_t*)data)[pos]);
+#else
+	if (format == POLY_PCM_S16)
+		return ((const int16_t*)data)[pos];
+	return 256 * ((const int8_t*)data)[pos];
+#endif
+}
+#endif
+
+/*!
+ * Emit white noise for the given voice at the given time.  The noise is
+ * a hash of the voice number and time, so it is reproducible from the
+ * voice state alone.  Returns a value between -256 and 255.
+ */
+static inline int16_t poly_noise(uint8_t vid, uint16_t time) {
+	uint16_t x = time + (vid * 0x9e37U);
+	x ^= x >> 8;
+	x *= 0x88b5U;
+	x ^= x >> 7;
+	x *= 0xdb2dU;
+	x ^= x >> 9;
+	return (int16_t)(x >> 7) - 256;
+}
+
+/*!
+ * Advance the voice by one sample time step without computing its
+ * output.  This applies the frequency and amplitude deltas.
+ */
+static inline void poly_core_step(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint8_t vid) {
+	struct poly_voice_t* const voice = &cfg.voice[vid];
+#ifndef _POLY_NO_RAMP
+	if (voice->dscale && (!(voice->time % voice->dscale))) {
+		/* Delta frequency adjustment */
+		if (voice->dfreq) {
+			int32_t freq = voice->freq;
+			freq += voice->dfreq;
+			if (freq < 0) {
+				voice->freq = 0;
+				_POLY_CORE_TRACE(core, POLY_TRACE_CLAMP,
+						vid, 0);
+			} else if (freq > cfg.freq_max) {
+				voice->freq = cfg.freq_max;
+				_POLY_CORE_TRACE(core, POLY_TRACE_CLAMP,
+						vid, cfg.freq_max);
+			} else {
+				voice->freq = freq;
+				_POLY_CORE_TRACE(core, POLY_TRACE_FREQ,
+						vid, freq);
+			}
+		}
+
+		/* Delta amplitude adjustment */
+		if (voice->damp) {
+			int16_t amp = (int16_t)voice->amp
+				+ (int16_t)voice->damp;
+			if (amp < 0) {
+				voice->amp = 0;
+				voice->damp = 0;
+				_POLY_CORE_TRACE(core, POLY_TRACE_CLAMP,
+						vid | POLY_TRACE_CLAMP_AMP, 0);
+			} else if (amp > UINT8_MAX) {
+				voice->amp = UINT8_MAX;
+				voice->damp = 0;
+				_POLY_CORE_TRACE(core, POLY_TRACE_CLAMP,
+						vid | POLY_TRACE_CLAMP_AMP,
+						UINT8_MAX);
+			} else {
+				voice->amp = amp;
+				_POLY_CORE_TRACE(core, POLY_TRACE_AMP,
+						vid, amp);
+			}
+		}
+	}
+#else
+	(void)cfg;
+#endif
+	(void)core;
+
+#ifndef _POLY_NO_PCM
+	if (voice->flags & POLY_PCM)
+		poly_pcm_advance(voice, 1);
+#endif
+
+	/* Time step update */
+	voice->time++;
+}
+
+/*!
+ * Evaluate the output of a single voice at its current time.
+ */
+static inline int16_t poly_core_eval(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint8_t vid) {
+	const struct poly_voice_t* const voice = &cfg.voice[vid];
+	const int8_t amod = poly_voice_amod(voice);
+	int32_t amp = voice->amp;
+	int32_t sample = 0;
+
+	/* Amplitude modulation? */
+	if (amod >= 0) {
+		_DPRINTF("amplitude mod: %d + amp(%d)\n", amp, amod);
+		amp += cfg.voice[amod].sample;
+	}
+
+	_DPRINTF("amplitude %d\n", amp);
+	if (amp) {
+#ifndef _POLY_NO_PCM
+		if (voice->flags & POLY_PCM) {
+			const int8_t pmod = poly_voice_pmod(voice);
+			const int16_t offset = (pmod >= 0)
+				? cfg.voice[pmod].sample : 0;
+			sample = poly_pcm_sample(voice->flags
+					& POLY_WAVE_MASK, voice->pos, offset);
+			_DPRINTF("pcm %d @ %u%+d = %d\n",
+					voice->flags & POLY_WAVE_MASK,
+					voice->pos, offset, sample);
+			/* Full scale PCM to full scale wave, times amp */
+			sample = (sample * amp) >> 7;
+		} else
+#endif
+		/* Frequency modulation? */
+		if (voice->freq) {
+			if (voice->freq < UINT16_MAX) {
+				/* 
+				 * Time T is N/Fs.
+				 * Angle in ¼° is 1440*F*T
+				 */
+				int64_t angle = (4*POLY_SINE_SZ)
+					* voice->freq
+					* (int64_t)voice->time;
+				angle /= cfg.freq;
+				const int8_t pmod = poly_voice_pmod(voice);
+				if (pmod >= 0)
+					angle += cfg.voice[pmod].sample;
+				angle %= (4*POLY_SINE_SZ);
+				sample = poly_wave(voice->flags
+						& POLY_WAVE_MASK, angle);
+				_DPRINTF("wave %d Hz sample %d "
+						"(angle %ld) = %d\n",
+						voice->freq, voice->time,
+						angle, sample);
+			} else {
+				sample = poly_noise(vid, voice->time);
+				_DPRINTF("noise %d @ %d\n", sample, amp);
+			}
+			sample *= amp;
+			_DPRINTF("amplitude * sample = %d\n",
+					sample * amp);
+		} else {
+			/* DC */
+			_DPRINTF("DC = %d\n", amp);
+			sample = amp;
+		}
+		sample >>= poly_voice_ascale(voice);
+		_DPRINTF("scale %d = %d\n", poly_voice_ascale(voice),
+				sample);
+	} else {
+		/* No signal */
+		sample = 0;
+	}
+
+	/* Clipping */
+	if (sample > INT16_MAX) {
+		sample = INT16_MAX;
+		_POLY_CORE_STATS_INC(core, clipped);
+		_POLY_CORE_TRACE(core, POLY_TRACE_CLIP, vid, sample);
+	} else if (sample < INT16_MIN) {
+		sample = INT16_MIN;
+		_POLY_CORE_STATS_INC(core, clipped);
+		_POLY_CORE_TRACE(core, POLY_TRACE_CLIP, vid, sample);
+	}
+
+	_POLY_CORE_STATS_INC(core, computed);
+	return sample;
+}
+
+/*!
+ * Compute the output of a single voice and advance it one time step.
+ */
+static inline void poly_core_compute(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint8_t vid) {
+	struct poly_voice_t* const voice = &cfg.voice[vid];
+#ifndef _POLY_NO_RATE
+	if (voice->rcnt) {
+		/* Between evaluations: hold or interpolate */
+		voice->rcnt--;
+		voice->sample += voice->rstep;
+		poly_core_step(core, cfg, vid);
+		return;
+	}
+
+	voice->rcnt = voice->rdiv & POLY_RDIV_MASK;
+	if (voice->rdiv & POLY_RDIV_INTERP) {
+		/* Head towards the new value over the next period */
+		int32_t delta = (int32_t)poly_core_eval(core, cfg, vid)
+			- voice->sample;
+		voice->rstep = delta / (voice->rcnt + 1);
+		voice->sample += voice->rstep;
+		poly_core_step(core, cfg, vid);
+		return;
+	}
+#endif
+
+	/* Update sample */
+	voice->sample = poly_core_eval(core, cfg, vid);
+	poly_core_step(core, cfg, vid);
+}
+
+/*!
+ * Compute one voice for the next sample, or step it if it is shed.
+ * Returns its contribution to the mix.
+ * @param	mask	Channel bit for the voice.
+ * @param	keep	Channels that are never shed.
+ * @param	shed	Load shedding threshold, shifted to POLY_PRIO_BIT.
+ */
+static inline int16_t poly_core_voice(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint8_t vid, uint16_t mask,
+		uint16_t keep, uint8_t shed) {
+	if (!(keep & mask) && ((cfg.voice[vid].flags
+				& POLY_PRIO_MASK) > shed)) {
+		/* Shed: keep time, but leave out of the mix */
+		_DPRINTF("shed %d\n", vid);
+		if (core->enable & mask) {
+			poly_core_step(core, cfg, vid);
+			_POLY_CORE_STATS_INC(core, shed);
+		}
+		return 0;
+	}
+
+	if (core->enable & mask) {
+		_DPRINTF("compute %d\n", vid);
+		poly_core_compute(core, cfg, vid);
+	} else {
+		_DPRINTF("skip compute %d\n", vid);
+	}
+	if (core->mute & mask) {
+		_DPRINTF("muted %d\n", vid);
+		return 0;
+	}
+	return cfg.voice[vid].sample;
+}
+
+/*!
+ * Retrieve the next output sample from the polyphonic synthesizer.
+ */
+static inline int16_t poly_core_next(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg) {
+	/* Do not return samples unless we're in the waiting state. */
+	if (!core->remain)
+		return 0;
+
+	/* Compute all the voices, tally up the samples */
+	uint8_t vid;
+	int16_t sample = 0;
+	uint16_t mask = 1;
+	const uint8_t shed = core->shed << POLY_PRIO_BIT;
+	const uint16_t keep = core->modsrc;
+	for (vid = 0; vid < cfg.num_channels; vid++) {
+		sample += poly_core_voice(core, cfg, vid, mask, keep, shed);
+		mask <<= 1;
+	}
+
+	/* Decrement our global sample counter */
+	core->remain--;
+	_POLY_CORE_STATS_INC(core, samples);
+	_POLY_CORE_TRACE_CLOCK(core, 1);
+	return sample;
+}
+
+#ifndef __AVR_ARCH__
+/*!
+ * Split the channels into at most num_parts parts that can be rendered
+ * independently with poly_core_mix.  Channels connected by modulation
+ * routing are kept in the same part, and the parts are balanced by the
+ * number of enabled channels in each.  Every channel is assigned to a
+ * part, as disabled channels still contribute their last sample.
+ * @param	part		Receives the channel mask of each part.
+ * @param	num_parts	Maximum number of parts.
+ * @returns	Number of parts used.
+ */
+static inline uint8_t poly_core_split(const struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint16_t* const part,
+		uint8_t num_parts) {
+	uint8_t root[POLY_MAX_CHANNELS];
+	uint16_t group[POLY_MAX_CHANNELS];
+	uint8_t cost[POLY_MAX_CHANNELS];
+	uint8_t load[POLY_MAX_CHANNELS];
+	uint8_t vid, used = 0, total = 0, share;
+
+	if (num_parts > cfg.num_channels)
+		num_parts = cfg.num_channels;
+	if (!num_parts)
+		return 0;
+	memset(part, 0, sizeof(uint16_t) * num_parts);
+	memset(load, 0, sizeof(load));
+	memset(group, 0, sizeof(group));
+	memset(cost, 0, sizeof(cost));
+
+	/* Join each channel to its modulation sources */
+	for (vid = 0; vid < cfg.num_channels; vid++)
+		root[vid] = vid;
+	for (vid = 0; vid < cfg.num_channels; vid++) {
+		const int8_t src[2] = {
+			poly_voice_pmod(&cfg.voice[vid]),
+			poly_voice_amod(&cfg.voice[vid]),
+		};
+		uint8_t s;
+		for (s = 0; s < 2; s++) {
+			uint8_t a = vid, b;
+			if (src[s] < 0)
+				continue;
+			b = src[s];
+			while (root[a] != a)
+				a = root[a];
+			while (root[b] != b)
+				b = root[b];
+			if (a < b)
+				root[b] = a;
+			else
+				root[a] = b;
+		}
+	}
+	for (vid = 0; vid < cfg.num_channels; vid++) {
+		uint8_t r = vid;
+		while (root[r] != r)
+			r = root[r];
+		group[r] |= 1U << vid;
+		if (core->enable & (1U << vid))
+			cost[r]++;
+	}
+
+	/*
+	 * Fill the parts in channel order, each to a fair share of the
+	 * load, so that each part writes voices mostly adjacent in memory
+	 * rather than sharing cache lines with the others.
+	 */
+	for (vid = 0; vid < cfg.num_channels; vid++)
+		total += cost[vid];
+	share = (total + num_parts - 1) / num_parts;
+	for (vid = 0; vid < cfg.num_channels; vid++) {
+		if (!group[vid])
+			continue;
+		if (load[used] && ((load[used] + cost[vid]) > share)
+				&& ((used + 1) < num_parts))
+			used++;
+		part[used] |= group[vid];
+		load[used] += cost[vid];
+	}
+	return used + 1;
+}
+
+/*!
+ * Render the next samples of some of the channels into a partial mix,
+ * without advancing the sample counter.  The channels must be closed
+ * under modulation routing, as from poly_core_split, so that parts
+ * touch disjoint voices and may be rendered on separate threads.  The
+ * partial mixes of every part, added with 16-bit wrap-around, equal
+ * what poly_core_next would have returned.
+ * @param	voices		Channels to render.
+ * @param	mix		Receives the partial mix.
+ * @param	count		Number of samples; at most core->remain.
+ */
+static inline void poly_core_mix(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint16_t voices,
+		int16_t* const mix, uint16_t count) {
+	const uint8_t shed = core->shed << POLY_PRIO_BIT;
+	const uint16_t keep = core->modsrc;
+	uint16_t done;
+
+	for (done = 0; done < count; done++) {
+		int16_t sample = 0;
+		uint16_t mask = 1;
+		uint8_t vid;
+		for (vid = 0; vid < cfg.num_channels; vid++) {
+			if (voices & mask)
+				sample += poly_core_voice(core, cfg, vid,
+						mask, keep, shed);
+			mask <<= 1;
+		}
+		mix[done] = sample;
+	}
+}
+#endif
+
+/*!
+ * Check an output descriptor.
+ */
+static inline int poly_core_check_out(const struct poly_out_t* const out) {
+	const uint8_t width = out->format & POLY_OUT_WIDTH_MASK;
+	if ((width < 1) || (width > 4))
+		return -EINVAL;
+	if (out->format & ~(POLY_OUT_WIDTH_MASK | POLY_OUT_UNSIGNED
+				| POLY_OUT_FLOAT))
+		return -EINVAL;
+	if (out->format & POLY_OUT_FLOAT) {
+#ifdef POLY_OUT_F32
+		if (out->format != POLY_OUT_F32)
+#endif
+			return -EINVAL;
+	}
+	if ((out->shift < POLY_OUT_SHIFT_MIN)
+			|| (out->shift > POLY_OUT_SHIFT_MAX))
+		return -EINVAL;
+	if (!out->channels)
+		return -EINVAL;
+	return 0;
+}
+
+/*!
+ * Step the dither generator, a 16-bit Galois LFSR.
+ */
+static inline uint16_t poly_core_dither(uint16_t state) {
+	return (state >> 1) ^ ((state & 1) ? 0xb400 : 0);
+}
+
+/*!
+ * Draw the next dither value.  Successive states of the LFSR share all
+ * but one bit, so the generator is stepped past every bit of the last
+ * value to give one that is independent of it.
+ */
+static inline uint16_t poly_core_dither_draw(uint16_t state) {
+	uint8_t bit;
+	for (bit = 0; bit < 16; bit++)
+		state = poly_core_dither(state);
+	return state;
+}
+
+/*!
+ * Apply the gain shift and dither to a sample, saturating to the given
+ * sample width in bytes.
+ */
+static inline int32_t poly_core_scale(int16_t sample, uint8_t width,
+		struct poly_out_t* const out) {
+	int32_t value;
+	if (out->shift >= 0) {
+		value = (int32_t)sample * ((int32_t)1 << out->shift);
+	} else {
+		const uint8_t shift = -out->shift;
+		value = sample;
+		if (out->dither) {
+			/*
+			 * Triangular dither: difference of two independent
+			 * draws, plus half a step so the shift rounds.
+			 */
+			const uint16_t mask = (1U << shift) - 1;
+			uint16_t d = poly_core_dither_draw(out->dither);
+			value += (d & mask) + (1U << (shift - 1));
+			d = poly_core_dither_draw(d);
+			value -= d & mask;
+			out->dither = d;
+		}
+		value >>= shift;
+	}
+
+	if (width < 4) {
+		const int32_t max = ((int32_t)1 << (8*width - 1)) - 1;
+		if (value > max)
+			value = max;
+		else if (value < (-max - 1))
+			value = -max - 1;
+	}
+	return value;
+}
+
+/*!
+ * Write one sample to every channel of an output frame, converting it.
+ */
+static inline void poly_core_put(uint8_t* ptr, int16_t sample,
+		uint8_t width, uint32_t flip, struct poly_out_t* const out) {
+	uint8_t ch;
+#ifdef POLY_OUT_F32
+	if (out->format == POLY_OUT_F32) {
+		const float value = (out->shift >= 0)
+			? (float)sample * (float)(1L << out->shift)
+				/ 32768.0f
+			: (float)sample / (float)(1L << -out->shift)
+				/ 32768.0f;
+		for (ch = 0; ch < out->channels; ch++) {
+			memcpy(ptr, &value, sizeof(value));
+			ptr += sizeof(value);
+		}
+		return;
+	}
+#endif
+
+	const uint32_t value = (uint32_t)poly_core_scale(
+			sample, width, out) ^ flip;
+	for (ch = 0; ch < out->channels; ch++) {
+		switch (width) {
+		case 1:
+			*ptr = value;
+			break;
+		case 2: {
+			const uint16_t v = value;
+			memcpy(ptr, &v, sizeof(v));
+			break;
+		}
+		case 3:
+			ptr[0] = value;
+			ptr[1] = value >> 8;
+			ptr[2] = value >> 16;
+			break;
+		default:
+			memcpy(ptr, &value, sizeof(value));
+		}
+		ptr += width;
+	}
+}
+
+/*!
+ * Render samples into an output buffer, converting them on the way.
+ */
+static inline int poly_core_render(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, void* const buffer,
+		uint16_t count, struct poly_out_t* const out) {
+	int res = poly_core_check_out(out);
+	if (res < 0)
+		return res;
+
+	const uint8_t width = out->format & POLY_OUT_WIDTH_MASK;
+	const uint32_t flip = (out->format & POLY_OUT_UNSIGNED)
+		? ((uint32_t)1 << (8*width - 1)) : 0;
+	const uint16_t stride = out->stride
+		? out->stride : (uint16_t)(width * out->channels);
+	uint8_t* frame = (uint8_t*)buffer;
+	uint16_t done = 0;
+
+	while (core->remain && (done < count)) {
+		poly_core_put(frame, poly_core_next(core, cfg), width, flip,
+				out);
+		frame += stride;
+		done++;
+	}
+	return done;
+}
+
+#ifndef __AVR_ARCH__
+/*!
+ * Finish rendering samples split into parts with poly_core_mix: add up
+ * the partial mixes, advance the sample counter past them and convert
+ * them into an output buffer.
+ * @param	mix		Partial mixes, one per part.  The first is
+ *				overwritten with the total.
+ * @param	num_parts	Number of partial mixes.
+ * @param	count		Number of samples in each; at most
+ *				core->remain.
+ * @returns	count, or -EINVAL if the descriptor is not valid.
+ */
+static inline int poly_core_join(struct poly_core_t* const core,
+		int16_t* const* const mix, uint8_t num_parts,
+		void* const buffer, uint16_t count,
+		struct poly_out_t* const out) {
+	int res = poly_core_check_out(out);
+	if (res < 0)
+		return res;
+
+	const uint8_t width = out->format & POLY_OUT_WIDTH_MASK;
+	const uint32_t flip = (out->format & POLY_OUT_UNSIGNED)
+		? ((uint32_t)1 << (8*width - 1)) : 0;
+	const uint16_t stride = out->stride
+		? out->stride : (uint16_t)(width * out->channels);
+	int16_t* const total = mix[0];
+	uint8_t* frame = (uint8_t*)buffer;
+	uint16_t done;
+	uint8_t p;
+
+	/* The serial mix wraps, so the partial mixes add up exactly */
+	for (p = 1; p < num_parts; p++)
+		for (done = 0; done < count; done++)
+			total[done] += mix[p][done];
+
+	for (done = 0; done < count; done++) {
+		poly_core_put(frame, total[done], width, flip, out);
+		frame += stride;
+	}
+
+	core->remain -= count;
+#ifdef _POLY_STATS
+	core->stats->samples += count;
+#endif
+	_POLY_CORE_TRACE_CLOCK(core, count);
+	return count;
+}
+#endif
+
+#ifndef _POLY_NO_RAMP
+/*!
+ * Count the ramp ticks in the next count samples: the times in
+ * [time, time + count) that are multiples of dscale, remembering that
+ * time wraps around.
+ */
+static inline uint16_t poly_core_ticks(uint16_t time, uint16_t count,
+		uint16_t dscale) {
+	const uint32_t end = (uint32_t)time + count;
+	/* Multiples of dscale below x */
+#define _POLY_MULTIPLES(x)	(((uint32_t)(x) + dscale - 1) / dscale)
+	if (end <= (UINT16_MAX + 1UL))
+		return _POLY_MULTIPLES(end) - _POLY_MULTIPLES(time);
+	return _POLY_MULTIPLES(UINT16_MAX + 1UL) - _POLY_MULTIPLES(time)
+		+ _POLY_MULTIPLES(end - (UINT16_MAX + 1UL));
+#undef _POLY_MULTIPLES
+}
+#endif
+
+/*!
+ * Advance the voice by count sample time steps without computing its
+ * output, with the same result as calling poly_core_step count times.
+ * The ramps are applied in closed form: once clamped, a frequency
+ * stays at its limit, and clamping an amplitude stops its ramp.
+ */
+static inline void poly_core_step_many(const struct poly_cfg_t cfg,
+		struct poly_voice_t* const voice, uint16_t count) {
+#ifndef _POLY_NO_RAMP
+	uint16_t ticks = 0;
+#ifndef _POLY_NO_PCM
+	if ((voice->flags & POLY_PCM) && voice->dfreq && voice->dscale
+			&& (count > 1)) {
+		/* The playback rate moves under the position: one by one */
+		while (count--)
+			poly_core_step_many(cfg, voice, 1);
+		return;
+	}
+#endif
+	if (voice->dscale && (voice->dfreq || voice->damp))
+		ticks = poly_core_ticks(voice->time, count, voice->dscale);
+
+	if (ticks && voice->dfreq) {
+		/*
+		 * The first tick brings the frequency into range (noise
+		 * is above it), after which it moves linearly.
+		 */
+		int32_t freq = (int32_t)voice->freq + voice->dfreq;
+		if (freq < 0)
+			freq = 0;
+		else if (freq > cfg.freq_max)
+			freq = cfg.freq_max;
+		freq += (int32_t)(ticks - 1) * voice->dfreq;
+		if (freq < 0)
+			voice->freq = 0;
+		else if (freq > cfg.freq_max)
+			voice->freq = cfg.freq_max;
+		else
+			voice->freq = freq;
+	}
+
+	if (ticks && voice->damp) {
+		int32_t amp = (int32_t)voice->amp
+			+ (int32_t)ticks * voice->damp;
+		if (amp < 0) {
+			voice->amp = 0;
+			voice->damp = 0;
+		} else if (amp > UINT8_MAX) {
+			voice->amp = UINT8_MAX;
+			voice->damp = 0;
+		} else
+			voice->amp = amp;
+	}
+#else
+	(void)cfg;
+#endif
+
+#ifndef _POLY_NO_PCM
+	if (voice->flags & POLY_PCM)
+		poly_pcm_advance(voice, count);
+#endif
+	voice->time += count;
+}
+
+#ifndef _POLY_NO_RATE
+/*!
+ * Advance a reduced-rate voice that reads no other voice by count
+ * samples, evaluating it only where it would be evaluated anyway.
+ */
+static inline void poly_core_skip_rate(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint8_t vid, uint16_t count) {
+	struct poly_voice_t* const voice = &cfg.voice[vid];
+	while (count) {
+		uint16_t hold = voice->rcnt;
+		if (hold > count)
+			hold = count;
+
+		/* Hold or interpolate up to the next evaluation */
+		voice->sample = (uint16_t)voice->sample
+			+ (uint16_t)voice->rstep * hold;
+		voice->rcnt -= hold;
+		poly_core_step_many(cfg, voice, hold);
+		count -= hold;
+
+		if (count) {
+			poly_core_compute(core, cfg, vid);
+			count--;
+		}
+	}
+}
+#endif
+
+/*!
+ * Skip samples of the current segment without mixing any output,
+ * leaving the synthesizer as if poly_core_next had been called that
+ * many times.  Voices that are not modulation sources are advanced in
+ * closed form, and reduced-rate voices that read no other voice are
+ * evaluated only at their own rate.  Modulation sources, and the
+ * reduced-rate voices they modulate, are computed sample by sample.
+ * The final sample is computed in full, so that the last computed
+ * sample of every voice is as it would be after playback.
+ * @returns	Number of samples skipped.
+ */
+static inline uint16_t poly_core_skip(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg, uint16_t samples) {
+	const uint8_t shed = core->shed << POLY_PRIO_BIT;
+	const uint16_t keep = core->modsrc;
+	uint16_t lockstep = 0;
+	uint16_t count, mask;
+	uint8_t vid;
+
+	if (samples > core->remain)
+		samples = core->remain;
+	if (!samples)
+		return 0;
+	count = samples - 1;
+
+	for (vid = 0, mask = 1; vid < cfg.num_channels; vid++, mask <<= 1) {
+		struct poly_voice_t* const voice = &cfg.voice[vid];
+		if (!(core->enable & mask))
+			continue;
+
+		if (!(keep & mask)
+				&& ((voice->flags & POLY_PRIO_MASK) > shed)) {
+			/* Shed: only stepped */
+			poly_core_step_many(cfg, voice, count);
+		} else if (core->modsrc & mask) {
+			lockstep |= mask;
+#ifndef _POLY_NO_RATE
+		} else if (voice->rdiv) {
+			if ((poly_voice_pmod(voice) >= 0)
+					|| (poly_voice_amod(voice) >= 0))
+				lockstep |= mask;
+			else
+				poly_core_skip_rate(core, cfg, vid, count);
+#endif
+		} else {
+			poly_core_step_many(cfg, voice, count);
+		}
+	}
+
+	/* Voices that read each other, in playback order */
+	if (lockstep) {
+		uint16_t i;
+		for (i = 0; i < count; i++) {
+			for (vid = 0, mask = 1; vid < cfg.num_channels;
+					vid++, mask <<= 1) {
+				if (lockstep & mask)
+					poly_core_compute(core, cfg, vid);
+			}
+		}
+	}
+
+	core->remain -= count;
+	_POLY_CORE_TRACE_CLOCK(core, count);
+	poly_core_next(core, cfg);
+	return samples;
+}
+
+/*!
+ * Take a snapshot of the synthesizer state.
+ */
+static inline void poly_core_snapshot(const struct poly_core_t* const core,
+		const struct poly_cfg_t cfg,
+		struct poly_state_t* const state) {
+	state->remain = core->remain;
+	state->enable = core->enable;
+	state->mute = core->mute;
+	memcpy(state->voice, cfg.voice,
+			sizeof(struct poly_voice_t)*cfg.num_channels);
+}
+
+/*!
+ * Restore the synthesizer state from a snapshot.
+ */
+static inline void poly_core_restore(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg,
+		const struct poly_state_t* const state) {
+	core->remain = state->remain;
+	core->enable = state->enable;
+	core->mute = state->mute;
+	memcpy(cfg.voice, state->voice,
+			sizeof(struct poly_voice_t)*cfg.num_channels);
+	poly_core_update_modsrc(core, cfg);
+}
+
+/*!
+ * Scan through a sequence of events, recording keyframes.
+ */
+static inline int poly_core_scan(struct poly_core_t* const core,
+		const struct poly_cfg_t cfg,
+		const struct poly_evt_t* const events, uint32_t num_events,
+		struct poly_keyframe_t* const keyframes,
+		uint16_t num_keyframes) {
+	struct poly_state_t saved;
+#ifdef _POLY_STATS
+	struct poly_stats_t saved_stats = *core->stats;
+#endif
+#ifdef _POLY_TRACE
+	/* The scan is not playback, so leave it out of the trace */
+	struct poly_trace_ring_t* const trace = core->trace;
+	core->trace = NULL;
+#endif
+	const uint8_t shed = core->shed;
+	uint32_t sample = 0;
+	uint32_t evt = 0;
+	uint16_t kf = 0;
+	int res = 0;
+
+	poly_core_snapshot(core, cfg, &saved);
+	core->shed = POLY_PRIO_LOWEST;
+	while (kf < num_keyframes) {
+		/* Record all keyframes for this event */
+		if (keyframes[kf].event == evt) {
+			keyframes[kf].sample = sample;
+			poly_core_snapshot(core, cfg, &keyframes[kf].state);
+			kf++;
+			continue;
+		}
+
+		if (evt >= num_events)
+			break;
+
+		res = poly_core_load(core, cfg, &events[evt]);
+		if (res < 0)
+			break;
+
+		sample += core->remain;
+		poly_core_skip(core, cfg, core->remain);
+		evt++;
+	}
+	poly_core_restore(core, cfg, &saved);
+	core->shed = shed;
+#ifdef _POLY_STATS
+	*core->stats = saved_stats;
+#endif
+#ifdef _POLY_TRACE
+	core->trace = trace;
+#endif
+
+	if (res < 0)
+		return res;
+	return kf;
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
+
+#endif
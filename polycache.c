@@ -0,0 +1,375 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers: rendered clip cache.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "polycache.h"
+#include "poly_core.h"
+#include <stdlib.h>
+
+/*! FNV-1a parameters */
+#define POLY_CACHE_FNV_BASIS	(0xcbf29ce484222325ULL)
+#define POLY_CACHE_FNV_PRIME	(0x00000100000001b3ULL)
+
+/*!
+ * Bytes of a starting state that take part in the key: the header and
+ * the channels rendered with.
+ */
+#define POLY_CACHE_STATE_SZ(cache)	\
+	(offsetof(struct poly_state_t, voice)				\
+	 + sizeof(struct poly_voice_t) * (cache)->num_channels)
+
+/*!
+ * Fold bytes into an FNV-1a hash.
+ */
+static uint64_t poly_cache_hash(uint64_t hash, const void* data,
+		size_t len) {
+	const uint8_t* byte = (const uint8_t*)data;
+	while (len--) {
+		hash ^= *(byte++);
+		hash *= POLY_CACHE_FNV_PRIME;
+	}
+	return hash;
+}
+
+/*!
+ * Copy the part of a starting state that takes part in the key into
+ * zeroed storage, field by field, so that padding bytes the caller left
+ * behind cannot cause spurious misses.
+ */
+static void poly_cache_key(const struct poly_cache_t* const cache,
+		const struct poly_state_t* const state,
+		struct poly_state_t* const key) {
+	uint8_t ch;
+	memset(key, 0, sizeof(*key));
+	key->remain = state->remain;
+	key->enable = state->enable;
+	key->mute = state->mute;
+	for (ch = 0; ch < cache->num_channels; ch++) {
+		const struct poly_voice_t* const src = &state->voice[ch];
+		struct poly_voice_t* const dst = &key->voice[ch];
+		dst->sample = src->sample;
+		dst->time = src->time;
+		dst->freq = src->freq;
+#ifndef _POLY_NO_PCM
+		dst->pos = src->pos;
+#endif
+#ifndef _POLY_NO_RAMP
+		dst->dfreq = src->dfreq;
+		dst->dscale = src->dscale;
+		dst->damp = src->damp;
+#endif
+		dst->amp = src->amp;
+#if defined(_POLY_PACKED) && !defined(_POLY_NO_MOD)
+		dst->route = src->route;
+#else
+		dst->ascale = src->ascale;
+#endif
+#if !defined(_POLY_PACKED) && !defined(_POLY_NO_MOD)
+		dst->pmod = src->pmod;
+		dst->amod = src->amod;
+#endif
+		dst->flags = src->flags;
+#ifndef _POLY_NO_RATE
+		dst->rdiv = src->rdiv;
+		dst->rcnt = src->rcnt;
+		dst->rstep = src->rstep;
+#endif
+	}
+}
+
+/*!
+ * Unlink a clip from the LRU list.
+ */
+static void poly_cache_unlink(struct poly_cache_t* const cache,
+		struct poly_clip_t* const clip) {
+	if (clip->newer)
+		clip->newer->older = clip->older;
+	else
+		cache->newest = clip->older;
+	if (clip->older)
+		clip->older->newer = clip->newer;
+	else
+		cache->oldest = clip->newer;
+	clip->newer = NULL;
+	clip->older = NULL;
+}
+
+/*!
+ * Link a clip in at the newest end of the LRU list.
+ */
+static void poly_cache_link(struct poly_cache_t* const cache,
+		struct poly_clip_t* const clip) {
+	clip->older = cache->newest;
+	clip->newer = NULL;
+	if (cache->newest)
+		cache->newest->newer = clip;
+	else
+		cache->oldest = clip;
+	cache->newest = clip;
+}
+
+/*!
+ * Take a clip out of the cache.  It is freed if nobody holds it.
+ */
+static void poly_cache_remove(struct poly_cache_t* const cache,
+		struct poly_clip_t* const clip) {
+	struct poly_clip_t** link =
+		&cache->bucket[clip->hash % POLY_CACHE_BUCKETS];
+	while (*link != clip)
+		link = &(*link)->next;
+	*link = clip->next;
+	poly_cache_unlink(cache, clip);
+
+	clip->cached = 0;
+	cache->stats.clips--;
+	cache->stats.bytes -= clip->size;
+	if (!clip->refs)
+		free(clip);
+}
+
+/*!
+ * Evict least recently used clips that nobody holds until there is
+ * room for the given number of bytes.
+ * @returns	Non-zero if there is room.
+ */
+static int poly_cache_evict(struct poly_cache_t* const cache, size_t size) {
+	struct poly_clip_t* clip = cache->oldest;
+	if (size > cache->budget)
+		return 0;
+	while (clip && ((cache->stats.bytes + size) > cache->budget)) {
+		struct poly_clip_t* const newer = clip->newer;
+		if (!clip->refs) {
+			poly_cache_remove(cache, clip);
+			cache->stats.evictions++;
+		}
+		clip = newer;
+	}
+	return (cache->stats.bytes + size) <= cache->budget;
+}
+
+/*!
+ * Render the clip's events into its sample buffer.
+ */
+static int poly_cache_render(const struct poly_cache_t* const cache,
+		struct poly_clip_t* const clip) {
+	struct poly_voice_t voice[POLY_STATE_CHANNELS];
+#ifdef _POLY_STATS
+	struct poly_stats_t stats;
+#endif
+	struct poly_core_t core;
+	const struct poly_cfg_t cfg = {
+		.voice = voice,
+		.num_channels = cache->num_channels,
+		.freq = cache->freq,
+		.freq_max = cache->freq / 2,
+	};
+	int16_t* pcm = (int16_t*)clip->pcm;
+	uint32_t evt = 0;
+
+	memset(&core, 0, sizeof(core));
+#ifdef _POLY_STATS
+	memset(&stats, 0, sizeof(stats));
+	core.stats = &stats;
+#endif
+	core.shed = POLY_PRIO_LOWEST;
+	poly_core_reset(&core, cfg);
+	if (clip->state)
+		poly_core_restore(&core, cfg, clip->state);
+
+	while (1) {
+		uint32_t count = clip->num_events - evt;
+		int res;
+
+		while (core.remain)
+			*(pcm++) = poly_core_next(&core, cfg);
+
+		if (!count)
+			return 0;
+		res = poly_core_load_many(&core, cfg, &clip->events[evt],
+				(count > UINT16_MAX) ? UINT16_MAX : count,
+				NULL);
+		if (res < 0)
+			return res;
+		evt += res;
+	}
+}
+
+/*!
+ * Initialise an empty cache.
+ */
+int poly_cache_init(struct poly_cache_t* const cache, uint8_t num_channels,
+		uint16_t freq, size_t budget) {
+	if (!num_channels || (num_channels > POLY_STATE_CHANNELS))
+		return -EINVAL;
+	memset(cache, 0, sizeof(*cache));
+	cache->num_channels = num_channels;
+	cache->freq = freq;
+	cache->budget = budget;
+	return 0;
+}
+
+/*!
+ * Free every clip.
+ */
+void poly_cache_clear(struct poly_cache_t* const cache) {
+	while (cache->newest)
+		poly_cache_remove(cache, cache->newest);
+}
+
+/*!
+ * Get the clip for an event sequence, rendering it on a miss.
+ */
+int poly_cache_get(struct poly_cache_t* const cache,
+		const struct poly_state_t* const state,
+		const struct poly_evt_t* const events, uint32_t num_events,
+		struct poly_clip_t** const clip) {
+	const size_t state_sz = state ? POLY_CACHE_STATE_SZ(cache) : 0;
+	const size_t events_sz = sizeof(struct poly_evt_t) * num_events;
+	const uint8_t has_state = state ? 1 : 0;
+	struct poly_state_t key;
+	struct poly_clip_t* found;
+	uint64_t hash = POLY_CACHE_FNV_BASIS;
+	uint64_t len = state ? state->remain : 0;
+	uint8_t* ptr;
+	uint32_t evt;
+	size_t size;
+	int res;
+
+	if (state)
+		poly_cache_key(cache, state, &key);
+	hash = poly_cache_hash(hash, &has_state, sizeof(has_state));
+	if (state)
+		hash = poly_cache_hash(hash, &key, state_sz);
+	hash = poly_cache_hash(hash, events, events_sz);
+
+	for (found = cache->bucket[hash % POLY_CACHE_BUCKETS]; found;
+			found = found->next) {
+		if ((found->hash == hash)
+				&& (found->has_state == has_state)
+				&& (found->num_events == num_events)
+				&& !memcmp(found->events, events, events_sz)
+				&& (!state || !memcmp(found->state, &key,
+						state_sz))) {
+			poly_cache_unlink(cache, found);
+			poly_cache_link(cache, found);
+			found->refs++;
+			cache->stats.hits++;
+			*clip = found;
+			return 0;
+		}
+	}
+
+	/* Miss: work out the length and render it */
+	for (evt = 0; evt < num_events; evt++)
+		if ((events[evt].flags & POLY_EVT_TYPE_MASK)
+				== POLY_EVT_TYPE_TIME)
+			len += events[evt].value;
+
+	size = sizeof(struct poly_clip_t) + state_sz + events_sz
+		+ (sizeof(int16_t) * len);
+	found = malloc(size);
+	if (!found)
+		return -ENOMEM;
+
+	memset(found, 0, sizeof(*found));
+	found->hash = hash;
+	found->size = size;
+	found->refs = 1;
+	found->has_state = has_state;
+	found->num_events = num_events;
+	found->len = len;
+	ptr = (uint8_t*)(found + 1);
+	if (state) {
+		memcpy(ptr, &key, state_sz);
+		found->state = (const struct poly_state_t*)ptr;
+		ptr += state_sz;
+	}
+	memcpy(ptr, events, events_sz);
+	found->events = (const struct poly_evt_t*)ptr;
+	ptr += events_sz;
+	found->pcm = (const int16_t*)ptr;
+
+	res = poly_cache_render(cache, found);
+	if (res < 0) {
+		free(found);
+		return res;
+	}
+	cache->stats.misses++;
+
+	if (poly_cache_evict(cache, size)) {
+		struct poly_clip_t** const bucket =
+			&cache->bucket[hash % POLY_CACHE_BUCKETS];
+		found->next = *bucket;
+		*bucket = found;
+		poly_cache_link(cache, found);
+		found->cached = 1;
+		cache->stats.clips++;
+		cache->stats.bytes += size;
+	} else {
+		cache->stats.uncached++;
+	}
+
+	*clip = found;
+	return 0;
+}
+
+/*!
+ * Give back a clip.
+ */
+void poly_cache_put(struct poly_cache_t* const cache,
+		struct poly_clip_t* const clip) {
+	(void)cache;
+	clip->refs--;
+	if (!clip->refs && !clip->cached)
+		free(clip);
+}
+
+/*!
+ * Read the cache statistics.
+ */
+void poly_cache_stats(const struct poly_cache_t* const cache,
+		struct poly_cache_stats_t* const stats) {
+	*stats = cache->stats;
+}
+
+/*!
+ * Mix part of a clip into a buffer.
+ */
+uint32_t poly_clip_mix(const struct poly_clip_t* const clip, uint32_t pos,
+		int16_t* const out, uint32_t count) {
+	uint32_t done;
+	if (pos >= clip->len)
+		return 0;
+	if (count > (clip->len - pos))
+		count = clip->len - pos;
+
+	for (done = 0; done < count; done++) {
+		int32_t sample = (int32_t)out[done] + clip->pcm[pos + done];
+		if (sample > INT16_MAX)
+			sample = INT16_MAX;
+		else if (sample < INT16_MIN)
+			sample = INT16_MIN;
+		out[done] = sample;
+	}
+	return count;
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
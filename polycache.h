@@ -0,0 +1,149 @@
+#ifndef _POLYCACHE_H
+#define _POLYCACHE_H
+
+/*!
+ * Polyphonic synthesizer for microcontrollers: rendered clip cache.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "poly.h"
+#include <stddef.h>
+
+/*! Number of hash buckets */
+#define POLY_CACHE_BUCKETS	(256)
+
+/*!
+ * A rendered clip: the samples an event sequence produces from a given
+ * starting state.  Fields are read-only to the application.
+ */
+struct poly_clip_t {
+	struct poly_clip_t*	next;		/*!< Hash chain */
+	struct poly_clip_t*	newer;		/*!< LRU list, towards newest */
+	struct poly_clip_t*	older;		/*!< LRU list, towards oldest */
+	uint64_t		hash;		/*!< Key hash */
+	size_t			size;		/*!< Bytes charged to the cache */
+	uint32_t		refs;		/*!< Users holding the clip */
+	uint8_t			cached;		/*!< Clip is in the cache */
+	uint8_t			has_state;	/*!< Starting state given */
+	uint32_t		num_events;	/*!< Number of events */
+	const struct poly_evt_t*	events;	/*!< Events rendered */
+	const struct poly_state_t*	state;	/*!< Starting state, or NULL */
+	uint32_t		len;		/*!< Number of samples */
+	const int16_t*		pcm;		/*!< Samples, as poly_next */
+};
+
+/*!
+ * Cache statistics.
+ */
+struct poly_cache_stats_t {
+	uint32_t	hits;		/*!< Clips found in the cache */
+	uint32_t	misses;		/*!< Clips rendered */
+	uint32_t	evictions;	/*!< Clips evicted to make room */
+	uint32_t	uncached;	/*!< Clips rendered but not kept */
+	uint32_t	clips;		/*!< Clips in the cache */
+	size_t		bytes;		/*!< Bytes in use */
+};
+
+/*!
+ * Clip cache.  Fields are private; use the functions below.
+ */
+struct poly_cache_t {
+	struct poly_clip_t*	bucket[POLY_CACHE_BUCKETS];
+	struct poly_clip_t*	newest;		/*!< Most recently used */
+	struct poly_clip_t*	oldest;		/*!< Least recently used */
+	size_t			budget;		/*!< Byte limit */
+	uint8_t			num_channels;	/*!< Rendering channels */
+	uint16_t		freq;		/*!< Rendering sample rate */
+	struct poly_cache_stats_t	stats;
+};
+
+/*!
+ * Initialise an empty cache.
+ * @param	cache		Cache to initialise.
+ * @param	num_channels	Channels to render with; at most
+ *				POLY_STATE_CHANNELS.
+ * @param	freq		Sample rate to render at.
+ * @param	budget		Bytes the cache may hold, including the
+ *				events and states used as keys.
+ * @retval	0		Success
+ * @retval	-EINVAL		Too many channels.
+ */
+int poly_cache_init(struct poly_cache_t* const cache, uint8_t num_channels,
+		uint16_t freq, size_t budget);
+
+/*!
+ * Free every clip.  Clips still held are freed when put back.
+ */
+void poly_cache_clear(struct poly_cache_t* const cache);
+
+/*!
+ * Get the clip for an event sequence, rendering it on a miss.  The
+ * events are played on a private synthesizer from the starting state,
+ * at full quality (no load shedding), to the end of their last TIME
+ * event.  Noise is a function of voice state, so noisy sounds cache
+ * as well as any other.
+ *
+ * The clip is held until given back with poly_cache_put, and is not
+ * evicted while held.  If it cannot be kept within the budget, it is
+ * still returned, and freed when put back.
+ *
+ * @param	cache		Cache to look in.
+ * @param	state		Starting state, or NULL to start from reset.
+ * @param	events		Events to render.
+ * @param	num_events	Number of events.
+ * @param	clip		Receives the clip.
+ * @retval	0		Success
+ * @retval	-EINVAL		Bad event, as per poly_load.
+ * @retval	-ERANGE		Bad value, as per poly_load.
+ * @retval	-EINPROGRESS	Event before the state's segment ended.
+ * @retval	-ENOMEM		Out of memory.
+ */
+int poly_cache_get(struct poly_cache_t* const cache,
+		const struct poly_state_t* const state,
+		const struct poly_evt_t* const events, uint32_t num_events,
+		struct poly_clip_t** const clip);
+
+/*!
+ * Give back a clip obtained from poly_cache_get.
+ */
+void poly_cache_put(struct poly_cache_t* const cache,
+		struct poly_clip_t* const clip);
+
+/*!
+ * Read the cache statistics.
+ */
+void poly_cache_stats(const struct poly_cache_t* const cache,
+		struct poly_cache_stats_t* const stats);
+
+/*!
+ * Mix part of a clip into a buffer, saturating.
+ * @param	clip		Clip to mix.
+ * @param	pos		Sample of the clip to start from.
+ * @param	out		Buffer to mix into.
+ * @param	count		Maximum number of samples to mix.
+ * @returns	Number of samples mixed; fewer than count at the end of
+ *		the clip.
+ */
+uint32_t poly_clip_mix(const struct poly_clip_t* const clip, uint32_t pos,
+		int16_t* const out, uint32_t count);
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
+
+#endif
@@ -0,0 +1,402 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers: event stream optimiser.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "polyopt.h"
+#include "poly_core.h"
+#include <stdlib.h>
+
+/*! Number of event types */
+#define POLY_OPT_TYPES		(16)
+
+/*!
+ * Event type index, for per-type tables.  WAVE and PCM both write the
+ * waveform field, so they share an index: one overwrites the other, and
+ * sorting keeps them in order.
+ */
+#define POLY_OPT_TYPE(evt)	((((evt)->flags & POLY_EVT_TYPE_MASK) \
+			== POLY_EVT_TYPE_PCM)				\
+		? (POLY_EVT_TYPE_WAVE >> POLY_EVT_TYPE_BIT)		\
+		: (((evt)->flags & POLY_EVT_TYPE_MASK) >> POLY_EVT_TYPE_BIT))
+
+/*!
+ * Optimiser state.  The stream is played through a private synthesizer
+ * instance, so register values are known exactly, except where noted.
+ *
+ * A write is "pending" from when it is loaded until something depends
+ * on it.  A pending write that is overwritten, or reset by END, never
+ * affected the output and is removed.  Writes to a channel that is
+ * rendered, but whose output is not heard (muted and not modulating
+ * another), have "evolved" the channel state; they must survive being
+ * overwritten, and are heard if the channel's last sample is, but are
+ * still dead if END arrives first.
+ */
+struct poly_opt_t {
+	struct poly_core_t	core;
+	struct poly_voice_t	voice[POLY_MAX_CHANNELS];
+	struct poly_cfg_t	cfg;
+#ifdef _POLY_STATS
+	struct poly_stats_t	core_stats;
+#endif
+	/*! Events to keep */
+	uint8_t*		keep;
+	/*! Pending writes per channel and type: event index + 1 */
+	uint32_t		pending[POLY_MAX_CHANNELS][POLY_OPT_TYPES];
+	/*! Pending writes that have evolved the channel, by type */
+	uint16_t		evolved[POLY_MAX_CHANNELS];
+	/*! Pending ENABLE and MUTE writes: event index + 1 */
+	uint32_t		gpending[POLY_OPT_TYPES];
+	/*!
+	 * Channels whose time, frequency and amplitude are known.  They
+	 * are not if rendered before the enabled channels are known.
+	 */
+	uint16_t		known;
+	/*!
+	 * Channels whose rate divider counters are known to be clear.
+	 * Once rendered they are not, as they depend on load shedding.
+	 */
+	uint16_t		rate_clean;
+	uint8_t			known_enable;	/*!< Enabled channels known */
+	uint8_t			known_mute;	/*!< Muted channels known */
+	struct poly_opt_stats_t	stats;
+};
+
+/*!
+ * Remove a dead event.
+ */
+static void poly_opt_dead(struct poly_opt_t* const opt, uint32_t pending) {
+	if (pending) {
+		opt->keep[pending - 1] = 0;
+		opt->stats.dead++;
+	}
+}
+
+/*!
+ * Account for rendering a segment: decide which pending writes the
+ * output now depends on.
+ */
+static void poly_opt_render(struct poly_opt_t* const opt) {
+	uint8_t vid, type;
+	for (vid = 0; vid < opt->cfg.num_channels; vid++) {
+		const uint16_t mask = 1U << vid;
+		const uint8_t en = !opt->known_enable
+			|| (opt->core.enable & mask);
+		const uint8_t mu = opt->known_mute
+			&& (opt->core.mute & mask);
+		/*
+		 * The last sample is mixed or modulates another channel,
+		 * even when the channel is disabled.
+		 */
+		const uint8_t heard = !mu || (opt->core.modsrc & mask);
+
+		for (type = 0; type < POLY_OPT_TYPES; type++) {
+			const uint16_t tmask = 1U << type;
+			uint8_t used;
+			if (!opt->pending[vid][type])
+				continue;
+
+			switch (type << POLY_EVT_TYPE_BIT) {
+				case POLY_EVT_TYPE_PMOD:
+				case POLY_EVT_TYPE_AMOD:
+					/* Decides what is never shed */
+					used = 1;
+					break;
+				case POLY_EVT_TYPE_PRIO:
+					/*
+					 * Decides if the channel is shed, and
+					 * so computed or only stepped even
+					 * while muted.
+					 */
+					used = !mu || en;
+					break;
+				default:
+					/*
+					 * A disabled channel's sample was
+					 * only shaped by evolved writes.
+					 */
+					used = heard && (en || (opt->evolved[vid]
+							& tmask));
+			}
+
+			if (used) {
+				opt->pending[vid][type] = 0;
+				opt->evolved[vid] &= ~tmask;
+			} else if (en) {
+				opt->evolved[vid] |= tmask;
+			}
+		}
+
+		if (en) {
+			opt->rate_clean &= ~mask;
+			if (!opt->known_enable)
+				opt->known &= ~mask;
+		}
+	}
+
+	opt->gpending[POLY_EVT_TYPE_ENABLE >> POLY_EVT_TYPE_BIT] = 0;
+	opt->gpending[POLY_EVT_TYPE_MUTE >> POLY_EVT_TYPE_BIT] = 0;
+}
+
+/*!
+ * Load an ENABLE or MUTE event.
+ */
+static void poly_opt_global(struct poly_opt_t* const opt, uint32_t evt,
+		const struct poly_evt_t* const event) {
+	const uint8_t type = POLY_OPT_TYPE(event);
+	uint8_t* const known = ((event->flags & POLY_EVT_TYPE_MASK)
+			== POLY_EVT_TYPE_ENABLE)
+		? &opt->known_enable : &opt->known_mute;
+	const uint16_t value = ((event->flags & POLY_EVT_TYPE_MASK)
+			== POLY_EVT_TYPE_ENABLE)
+		? opt->core.enable : opt->core.mute;
+
+	if (*known && (value == event->value)) {
+		opt->keep[evt] = 0;
+		opt->stats.redundant++;
+		return;
+	}
+
+	poly_opt_dead(opt, opt->gpending[type]);
+	opt->gpending[type] = evt + 1;
+	*known = 1;
+	poly_core_apply(&opt->core, opt->cfg, event);
+}
+
+/*!
+ * Load an event that writes a channel register.
+ */
+static void poly_opt_voice(struct poly_opt_t* const opt, uint32_t evt,
+		const struct poly_evt_t* const event) {
+	const uint8_t vid = (event->flags >> POLY_CH_BIT) & 0x0f;
+	const uint8_t type = POLY_OPT_TYPE(event);
+	const uint16_t mask = 1U << vid;
+	const uint16_t modsrc = opt->core.modsrc;
+	struct poly_voice_t before;
+	uint8_t same;
+
+	memcpy(&before, &opt->voice[vid], sizeof(before));
+	poly_core_apply(&opt->core, opt->cfg, event);
+	same = !memcmp(&before, &opt->voice[vid], sizeof(before))
+		&& (modsrc == opt->core.modsrc);
+
+	/* Only trust registers the simulation tracks exactly */
+	switch (event->flags & POLY_EVT_TYPE_MASK) {
+		case POLY_EVT_TYPE_IFREQ:
+		case POLY_EVT_TYPE_IAMP:
+#ifndef _POLY_NO_RAMP
+		case POLY_EVT_TYPE_DAMP:
+#endif
+			same = same && (opt->known & mask);
+			break;
+#ifndef _POLY_NO_RATE
+		case POLY_EVT_TYPE_RATE:
+			same = same && (opt->known & opt->rate_clean & mask);
+			opt->rate_clean |= mask;
+			break;
+#endif
+	}
+
+	if (same) {
+		opt->keep[evt] = 0;
+		opt->stats.redundant++;
+		return;
+	}
+
+	if (!(opt->evolved[vid] & (1U << type)))
+		poly_opt_dead(opt, opt->pending[vid][type]);
+	opt->pending[vid][type] = evt + 1;
+	opt->evolved[vid] &= ~(1U << type);
+}
+
+/*!
+ * Load an END event: every pending channel write is now dead.
+ */
+static void poly_opt_end(struct poly_opt_t* const opt,
+		const struct poly_evt_t* const event) {
+	uint8_t vid, type;
+	for (vid = 0; vid < opt->cfg.num_channels; vid++) {
+		for (type = 0; type < POLY_OPT_TYPES; type++) {
+			poly_opt_dead(opt, opt->pending[vid][type]);
+			opt->pending[vid][type] = 0;
+		}
+		opt->evolved[vid] = 0;
+	}
+	poly_core_apply(&opt->core, opt->cfg, event);
+	opt->known = UINT16_MAX;
+	opt->rate_clean = UINT16_MAX;
+}
+
+/*!
+ * Sort key for events within a segment: ENABLE and MUTE first, then by
+ * channel and type.
+ */
+static uint16_t poly_opt_key(const struct poly_evt_t* const event) {
+	switch (event->flags & POLY_EVT_TYPE_MASK) {
+		case POLY_EVT_TYPE_ENABLE:
+		case POLY_EVT_TYPE_MUTE:
+			return POLY_OPT_TYPE(event);
+	}
+	return ((((event->flags >> POLY_CH_BIT) & 0x0f) + 1)
+			* POLY_OPT_TYPES) + POLY_OPT_TYPE(event);
+}
+
+/*!
+ * Sort the events of a segment.  Once dead writes are gone, no two
+ * events in a segment write the same register, so they commute.
+ */
+static void poly_opt_sort(struct poly_evt_t* const events, uint32_t len) {
+	uint32_t i, j;
+	for (i = 1; i < len; i++) {
+		const struct poly_evt_t event = events[i];
+		const uint16_t key = poly_opt_key(&event);
+		for (j = i; (j > 0) && (poly_opt_key(&events[j - 1]) > key);
+				j--)
+			events[j] = events[j - 1];
+		events[j] = event;
+	}
+}
+
+/*!
+ * Write out the kept events, sorting segments and merging TIME events.
+ * @returns	Number of events written.
+ */
+static uint32_t poly_opt_emit(struct poly_opt_t* const opt,
+		struct poly_evt_t* const events, uint32_t num_events) {
+	uint32_t evt, out = 0, start = 0;
+	for (evt = 0; evt < num_events; evt++) {
+		const struct poly_evt_t event = events[evt];
+		if (!opt->keep[evt])
+			continue;
+
+		switch (event.flags & POLY_EVT_TYPE_MASK) {
+			case POLY_EVT_TYPE_TIME:
+				poly_opt_sort(&events[start], out - start);
+				if ((out > 0) && (out == start)
+						&& ((events[out - 1].flags
+						& POLY_EVT_TYPE_MASK)
+						== POLY_EVT_TYPE_TIME)) {
+					/* Extend the previous TIME */
+					uint32_t sum = (uint32_t)event.value
+						+ events[out - 1].value;
+					if (sum <= UINT16_MAX) {
+						events[out - 1].value = sum;
+						opt->stats.time++;
+						break;
+					}
+					events[out - 1].value = UINT16_MAX;
+					events[out] = event;
+					events[out].value = sum - UINT16_MAX;
+				} else {
+					events[out] = event;
+				}
+				start = ++out;
+				break;
+			case POLY_EVT_TYPE_END:
+				poly_opt_sort(&events[start], out - start);
+				events[out] = event;
+				start = ++out;
+				break;
+			default:
+				events[out++] = event;
+		}
+	}
+	poly_opt_sort(&events[start], out - start);
+	return out;
+}
+
+/*!
+ * Optimise an event stream in place.
+ */
+int32_t poly_optimise(struct poly_evt_t* const events, uint32_t num_events,
+		uint8_t num_channels, uint16_t freq, uint32_t* const failed,
+		struct poly_opt_stats_t* const stats) {
+	struct poly_opt_t* opt;
+	uint32_t evt;
+	int32_t res = 0;
+
+	if (!num_channels || (num_channels > POLY_MAX_CHANNELS)
+			|| (freq < 2))
+		return -EINVAL;
+
+	opt = calloc(1, sizeof(*opt));
+	if (!opt)
+		return -ENOMEM;
+	opt->keep = malloc(num_events ? num_events : 1);
+	if (!opt->keep) {
+		free(opt);
+		return -ENOMEM;
+	}
+	memset(opt->keep, 1, num_events);
+
+	opt->cfg.voice = opt->voice;
+	opt->cfg.num_channels = num_channels;
+	opt->cfg.freq = freq;
+	opt->cfg.freq_max = freq / 2;
+	opt->core.shed = POLY_PRIO_LOWEST;
+#ifdef _POLY_STATS
+	opt->core.stats = &opt->core_stats;
+#endif
+	poly_core_reset(&opt->core, opt->cfg);
+	opt->known = UINT16_MAX;
+	opt->rate_clean = UINT16_MAX;
+
+	for (evt = 0; evt < num_events; evt++) {
+		const struct poly_evt_t* const event = &events[evt];
+		res = poly_core_check(opt->cfg, event, 0);
+		if (res < 0) {
+			if (failed)
+				*failed = evt;
+			goto out;
+		}
+
+		switch (event->flags & POLY_EVT_TYPE_MASK) {
+			case POLY_EVT_TYPE_TIME:
+				if (!event->value) {
+					opt->keep[evt] = 0;
+					opt->stats.time++;
+					break;
+				}
+				poly_opt_render(opt);
+				poly_core_apply(&opt->core, opt->cfg, event);
+				poly_core_skip(&opt->core, opt->cfg, opt->core.remain);
+				break;
+			case POLY_EVT_TYPE_END:
+				poly_opt_end(opt, event);
+				break;
+			case POLY_EVT_TYPE_ENABLE:
+			case POLY_EVT_TYPE_MUTE:
+				poly_opt_global(opt, evt, event);
+				break;
+			default:
+				poly_opt_voice(opt, evt, event);
+		}
+	}
+
+	res = poly_opt_emit(opt, events, num_events);
+	if (stats)
+		*stats = opt->stats;
+out:
+	free(opt->keep);
+	free(opt);
+	return res;
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
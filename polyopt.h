@@ -0,0 +1,76 @@
+#ifndef _POLYOPT_H
+#define _POLYOPT_H
+
+/*!
+ * Polyphonic synthesizer for microcontrollers: event stream optimiser.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "poly.h"
+
+/*!
+ * Optimiser statistics: the number of events removed for each reason.
+ */
+struct poly_opt_stats_t {
+	/*! Events that set registers to the values they already had */
+	uint32_t	redundant;
+	/*! Events overwritten, or reset by END, before taking effect */
+	uint32_t	dead;
+	/*! TIME events merged with a neighbour, or of zero length */
+	uint32_t	time;
+};
+
+/*!
+ * Optimise an event stream in place, for a synthesizer with the given
+ * number of channels and sample rate.  The stream is simulated to find
+ * events that cannot affect the output: writes of values registers
+ * already hold, and writes overwritten or reset by END before the
+ * channel is rendered.  These are removed, adjacent TIME events are
+ * merged and those of zero length dropped, and the events between each
+ * pair of TIME events are sorted by channel and type.
+ *
+ * Played from the same starting state, the optimised stream renders
+ * exactly the same output as the original, at any load shedding level.
+ * The stream is assumed to start with the voices reset, as after
+ * poly_reset or an END event; nothing is assumed about the enabled and
+ * muted channels.
+ *
+ * This is meant for preparing streams on a host and is not built into
+ * firmware.
+ *
+ * @param	events		Events to optimise, rewritten in place.
+ * @param	num_events	Number of events.
+ * @param	num_channels	Number of voice channels.
+ * @param	freq		Sample rate.
+ * @param	failed		If not NULL, receives the index of the
+ *				first bad event on failure.
+ * @param	stats		If not NULL, receives the number of
+ *				events removed for each reason.
+ * @returns	Number of events in the optimised stream, or a negative
+ *		error code: -EINVAL or -ERANGE as per poly_load, or
+ *		-ENOMEM.  On error, the events are left unchanged.
+ */
+int32_t poly_optimise(struct poly_evt_t* const events, uint32_t num_events,
+		uint8_t num_channels, uint16_t freq, uint32_t* const failed,
+		struct poly_opt_stats_t* const stats);
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
+
+#endif
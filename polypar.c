@@ -0,0 +1,185 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers: parallel rendering.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+
+#include "polypar.h"
+#include <sched.h>
+#include <string.h>
+
+/*!
+ * Times a worker polls for the next block before sleeping, and the
+ * caller polls for the workers before yielding.
+ */
+#define POLY_PAR_SPIN	(4096)
+
+/*
+ * The caller publishes each block by bumping block with release order,
+ * after setting up the parts; workers read it with acquire order.
+ * Workers publish their mixes by bumping done with release order, and
+ * the caller reads it with acquire order before joining.  Voices are
+ * only written by the part that owns them, so no other locking is
+ * needed.  The mutex only closes the race between a worker going to
+ * sleep and the caller waking it.
+ */
+
+static void* poly_par_worker(void* arg) {
+	struct poly_par_t* const par = (struct poly_par_t*)arg;
+	uint8_t id;
+	uint32_t seen = 0;
+
+	/* Find out which worker we are */
+	pthread_mutex_lock(&par->lock);
+	for (id = 1; !pthread_equal(par->thread[id], pthread_self()); id++)
+		;
+	pthread_mutex_unlock(&par->lock);
+
+	while (1) {
+		uint32_t spin = 0;
+		uint32_t block;
+
+		while ((block = atomic_load_explicit(&par->block,
+						memory_order_acquire)) == seen) {
+			if (++spin < POLY_PAR_SPIN)
+				continue;
+			pthread_mutex_lock(&par->lock);
+			while (atomic_load_explicit(&par->block,
+						memory_order_acquire) == seen)
+				pthread_cond_wait(&par->wake, &par->lock);
+			pthread_mutex_unlock(&par->lock);
+		}
+		seen = block;
+
+		if (par->stop)
+			return NULL;
+		if (id < par->num_parts)
+			poly_part_render(&par->part[id], par->count);
+		atomic_fetch_add_explicit(&par->done, 1,
+				memory_order_release);
+	}
+}
+
+/*!
+ * Start a parallel renderer.
+ */
+int poly_par_init(struct poly_par_t* const par, uint8_t num_threads) {
+	uint8_t id;
+	int res;
+
+	if (!num_threads || (num_threads > POLY_PAR_THREADS))
+		return -EINVAL;
+
+	par->num_threads = 1;
+	par->num_parts = 0;
+	par->count = 0;
+	par->stop = 0;
+	atomic_init(&par->block, 0);
+	atomic_init(&par->done, 0);
+	pthread_mutex_init(&par->lock, NULL);
+	pthread_cond_init(&par->wake, NULL);
+	memset(par->part, 0, sizeof(par->part));
+	for (id = 0; id < POLY_PAR_THREADS; id++)
+		par->part[id].mix = par->mix[id];
+
+	/* Hold the lock so workers see their thread IDs */
+	pthread_mutex_lock(&par->lock);
+	for (id = 1; id < num_threads; id++) {
+		res = pthread_create(&par->thread[id], NULL,
+				poly_par_worker, par);
+		if (res) {
+			pthread_mutex_unlock(&par->lock);
+			poly_par_free(par);
+			return -res;
+		}
+		par->num_threads++;
+	}
+	pthread_mutex_unlock(&par->lock);
+	return 0;
+}
+
+/*!
+ * Release the workers to run a block.
+ */
+static void poly_par_start(struct poly_par_t* const par) {
+	atomic_store_explicit(&par->done, 0, memory_order_relaxed);
+	pthread_mutex_lock(&par->lock);
+	atomic_fetch_add_explicit(&par->block, 1, memory_order_release);
+	pthread_cond_broadcast(&par->wake);
+	pthread_mutex_unlock(&par->lock);
+}
+
+/*!
+ * Wait for every worker to finish the block.
+ */
+static void poly_par_wait(struct poly_par_t* const par) {
+	uint32_t spin = 0;
+	while (atomic_load_explicit(&par->done, memory_order_acquire)
+			< (uint32_t)(par->num_threads - 1)) {
+		if (++spin < POLY_PAR_SPIN)
+			continue;
+		sched_yield();
+	}
+}
+
+/*!
+ * Stop a parallel renderer.
+ */
+void poly_par_free(struct poly_par_t* const par) {
+	uint8_t id;
+
+	par->stop = 1;
+	poly_par_start(par);
+	for (id = 1; id < par->num_threads; id++)
+		pthread_join(par->thread[id], NULL);
+	par->num_threads = 1;
+	pthread_cond_destroy(&par->wake);
+	pthread_mutex_destroy(&par->lock);
+}
+
+/*!
+ * Render samples, splitting each block across the threads.
+ */
+int poly_par_render(struct poly_par_t* const par, void* buffer,
+		uint16_t count, struct poly_out_t* const out) {
+	int res;
+
+	if (count > POLY_PAR_BLOCK)
+		count = POLY_PAR_BLOCK;
+	if (count > poly_remain)
+		count = poly_remain;
+
+	/* Check the descriptor before any voice moves on */
+	res = poly_split(par->part, par->num_threads, out);
+	if (res < 0)
+		return res;
+	par->count = count;
+	par->num_parts = res;
+	if (par->num_parts > 1)
+		poly_par_start(par);
+	if (par->num_parts)
+		poly_part_render(&par->part[0], count);
+	if (par->num_parts > 1)
+		poly_par_wait(par);
+
+	return poly_join(par->part, par->num_parts, buffer, count, out);
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
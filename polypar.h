@@ -0,0 +1,92 @@
+#ifndef _POLYPAR_H
+#define _POLYPAR_H
+
+/*!
+ * Polyphonic synthesizer for microcontrollers: parallel rendering.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "poly.h"
+#include <stdatomic.h>
+#include <pthread.h>
+
+/*! Most threads one renderer may use */
+#define POLY_PAR_THREADS	POLY_MAX_CHANNELS
+
+/*! Most samples rendered per block */
+#define POLY_PAR_BLOCK		(8192)
+
+/*!
+ * Parallel renderer.  The channels of the synthesizer are split into
+ * parts for each block, and each part is rendered by its own thread:
+ * the caller renders the first and worker threads the rest.  Workers
+ * spin briefly waiting for the next block, then sleep.
+ *
+ * Fields are private; use the functions below.
+ */
+struct poly_par_t {
+	pthread_t		thread[POLY_PAR_THREADS];
+	struct poly_part_t	part[POLY_PAR_THREADS];
+	int16_t			mix[POLY_PAR_THREADS][POLY_PAR_BLOCK];
+	uint8_t			num_threads;	/*!< Including the caller */
+	uint8_t			num_parts;	/*!< Parts this block */
+	uint16_t		count;		/*!< Samples this block */
+	uint8_t			stop;		/*!< Workers to exit */
+	_Atomic uint32_t	block;		/*!< Blocks started */
+	_Atomic uint32_t	done;		/*!< Workers finished */
+	pthread_mutex_t		lock;		/*!< Guards sleeping */
+	pthread_cond_t		wake;		/*!< Signals a new block */
+};
+
+/*!
+ * Start a parallel renderer's worker threads.
+ * @param	par		Renderer to start.
+ * @param	num_threads	Threads to render with, including the
+ *				caller; 1 to POLY_PAR_THREADS.
+ * @retval	0		Success
+ * @retval	-EINVAL		Bad number of threads.
+ * @returns	Other negative errno values from pthread_create.
+ */
+int poly_par_init(struct poly_par_t* const par, uint8_t num_threads);
+
+/*!
+ * Stop a parallel renderer's worker threads.
+ */
+void poly_par_free(struct poly_par_t* const par);
+
+/*!
+ * Render samples as poly_render does, splitting each block across the
+ * renderer's threads.  The output is exactly that of poly_render.
+ * Only one thread may call this at a time, and nothing else may drive
+ * the synthesizer meanwhile.
+ * @param	par		Renderer to use.
+ * @param	buffer		Buffer to write the first frame to.
+ * @param	count		Maximum number of frames to write; no more
+ *				than POLY_PAR_BLOCK are written.
+ * @param	out		Output descriptor.
+ * @returns	Number of frames written, or -EINVAL if the descriptor
+ *		is not valid.
+ */
+int poly_par_render(struct poly_par_t* const par, void* buffer,
+		uint16_t count, struct poly_out_t* const out);
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
+
+#endif
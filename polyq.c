@@ -0,0 +1,188 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers: live control queue.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "polyq.h"
+
+/*
+ * Each index is written by one side only: head by the producer, tail
+ * and clock by the consumer.  Publishing an index with release order
+ * makes the slots it covers visible to the other side, which reads it
+ * with acquire order.  Statistics are only ever added to by one side,
+ * so relaxed order is enough.
+ */
+#define _POLYQ_LOAD(var, order)	\
+	atomic_load_explicit(&(var), memory_order_ ## order)
+#define _POLYQ_STORE(var, val, order)	\
+	atomic_store_explicit(&(var), (val), memory_order_ ## order)
+#define _POLYQ_INC(var)	\
+	atomic_fetch_add_explicit(&(var), 1, memory_order_relaxed)
+
+/*!
+ * Initialise a queue.
+ */
+int poly_queue_init(struct poly_queue_t* const queue,
+		struct poly_qevt_t* const buffer, uint32_t size) {
+	if (!size || (size & (size - 1)))
+		return -EINVAL;
+
+	queue->buffer = buffer;
+	queue->mask = size - 1;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->clock, 0);
+	atomic_init(&queue->pushed, 0);
+	atomic_init(&queue->refused, 0);
+	atomic_init(&queue->applied, 0);
+	atomic_init(&queue->rejected, 0);
+	atomic_init(&queue->late, 0);
+	atomic_init(&queue->late_max, 0);
+	atomic_init(&queue->peak, 0);
+	return 0;
+}
+
+/*!
+ * Queue a control event.
+ */
+int poly_queue_push(struct poly_queue_t* const queue, uint64_t when,
+		const struct poly_evt_t* const event) {
+	const uint32_t head = _POLYQ_LOAD(queue->head, relaxed);
+	const uint32_t tail = _POLYQ_LOAD(queue->tail, acquire);
+	struct poly_qevt_t* qevt;
+
+	switch (event->flags & POLY_EVT_TYPE_MASK) {
+		case POLY_EVT_TYPE_TIME:
+		case POLY_EVT_TYPE_END:
+			return -EINVAL;
+	}
+
+	if ((head - tail) > queue->mask) {
+		_POLYQ_INC(queue->refused);
+		return -EAGAIN;
+	}
+
+	qevt = &queue->buffer[head & queue->mask];
+	qevt->when = when;
+	qevt->event = *event;
+	_POLYQ_STORE(queue->head, head + 1, release);
+	_POLYQ_INC(queue->pushed);
+	return 0;
+}
+
+/*!
+ * Read the sample clock.
+ */
+uint64_t poly_queue_clock(struct poly_queue_t* const queue) {
+	return _POLYQ_LOAD(queue->clock, relaxed);
+}
+
+/*!
+ * Count the events waiting in the queue.
+ */
+uint32_t poly_queue_level(struct poly_queue_t* const queue) {
+	const uint32_t tail = _POLYQ_LOAD(queue->tail, acquire);
+	return _POLYQ_LOAD(queue->head, acquire) - tail;
+}
+
+/*!
+ * Apply the events due at the given time.
+ * @returns	Samples until the next queued event is due, up to count.
+ */
+static uint16_t poly_queue_apply(struct poly_queue_t* const queue,
+		uint64_t clock, uint16_t count) {
+	const uint32_t head = _POLYQ_LOAD(queue->head, acquire);
+	uint32_t tail = _POLYQ_LOAD(queue->tail, relaxed);
+
+	if ((head - tail) > _POLYQ_LOAD(queue->peak, relaxed))
+		_POLYQ_STORE(queue->peak, head - tail, relaxed);
+
+	while (tail != head) {
+		const struct poly_qevt_t* const qevt
+			= &queue->buffer[tail & queue->mask];
+
+		if (qevt->when > clock) {
+			if ((qevt->when - clock) < count)
+				count = qevt->when - clock;
+			break;
+		}
+
+		if (qevt->when < clock) {
+			const uint64_t late = clock - qevt->when;
+			_POLYQ_INC(queue->late);
+			if (late > _POLYQ_LOAD(queue->late_max, relaxed))
+				_POLYQ_STORE(queue->late_max,
+						(late > UINT32_MAX)
+						? UINT32_MAX : late, relaxed);
+		}
+
+		if (poly_load_live(&qevt->event) < 0)
+			_POLYQ_INC(queue->rejected);
+		else
+			_POLYQ_INC(queue->applied);
+		tail++;
+	}
+
+	/* Hand the slots back to the producer */
+	_POLYQ_STORE(queue->tail, tail, release);
+	return count;
+}
+
+/*!
+ * Render samples, applying queued events as they fall due.
+ */
+int poly_queue_render(struct poly_queue_t* const queue, void* buffer,
+		uint16_t count, struct poly_out_t* const out) {
+	const uint16_t stride = out->stride ? out->stride
+		: (uint16_t)((out->format & POLY_OUT_WIDTH_MASK)
+				* out->channels);
+	uint64_t clock = _POLYQ_LOAD(queue->clock, relaxed);
+	uint8_t* frame = (uint8_t*)buffer;
+	uint16_t done = 0;
+
+	while (poly_remain && (done < count)) {
+		uint16_t len = poly_queue_apply(queue, clock, count - done);
+		int res = poly_render(frame, len, out);
+		if (res < 0)
+			return res;
+
+		frame += (uint32_t)res * stride;
+		done += res;
+		clock += res;
+		_POLYQ_STORE(queue->clock, clock, relaxed);
+	}
+	return done;
+}
+
+/*!
+ * Read the queue statistics.
+ */
+void poly_queue_stats(struct poly_queue_t* const queue,
+		struct poly_queue_stats_t* const stats) {
+	stats->pushed = _POLYQ_LOAD(queue->pushed, relaxed);
+	stats->refused = _POLYQ_LOAD(queue->refused, relaxed);
+	stats->applied = _POLYQ_LOAD(queue->applied, relaxed);
+	stats->rejected = _POLYQ_LOAD(queue->rejected, relaxed);
+	stats->late = _POLYQ_LOAD(queue->late, relaxed);
+	stats->late_max = _POLYQ_LOAD(queue->late_max, relaxed);
+	stats->peak = _POLYQ_LOAD(queue->peak, relaxed);
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
@@ -0,0 +1,141 @@
+#ifndef _POLYQ_H
+#define _POLYQ_H
+
+/*!
+ * Polyphonic synthesizer for microcontrollers: live control queue.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "poly.h"
+#include <stdatomic.h>
+
+/*!
+ * A queued control event: the event and the sample it is to be heard
+ * from, counted on the queue's sample clock.
+ */
+struct poly_qevt_t {
+	uint64_t		when;	/*!< Sample clock time */
+	struct poly_evt_t	event;	/*!< Control event */
+};
+
+/*!
+ * Live control queue.  A single producer thread (a user interface or
+ * network listener) pushes timestamped events, and the thread that
+ * renders applies them at the sample they are stamped with.  Neither
+ * side ever waits for the other: pushing to a full queue fails, and
+ * rendering applies whatever has arrived.
+ *
+ * Fields are private; use the functions below.
+ */
+struct poly_queue_t {
+	struct poly_qevt_t*	buffer;		/*!< Event storage */
+	uint32_t		mask;		/*!< Size - 1 */
+	_Atomic uint32_t	head;		/*!< Next slot to write */
+	_Atomic uint32_t	tail;		/*!< Next slot to read */
+	_Atomic uint64_t	clock;		/*!< Samples rendered */
+
+	/* Producer statistics */
+	_Atomic uint32_t	pushed;
+	_Atomic uint32_t	refused;
+
+	/* Consumer statistics */
+	_Atomic uint32_t	applied;
+	_Atomic uint32_t	rejected;
+	_Atomic uint32_t	late;
+	_Atomic uint32_t	late_max;
+	_Atomic uint32_t	peak;
+};
+
+/*!
+ * Queue statistics.
+ */
+struct poly_queue_stats_t {
+	uint32_t	pushed;		/*!< Events queued */
+	uint32_t	refused;	/*!< Pushes refused, queue full */
+	uint32_t	applied;	/*!< Events applied */
+	uint32_t	rejected;	/*!< Events refused by poly_load_live */
+	uint32_t	late;		/*!< Events applied after their time */
+	uint32_t	late_max;	/*!< Most samples an event was late */
+	uint32_t	peak;		/*!< Most events seen waiting */
+};
+
+/*!
+ * Initialise a queue, with its sample clock at zero.
+ * @param	queue		Queue to initialise.
+ * @param	buffer		Event storage.
+ * @param	size		Number of events in buffer; a power of two.
+ * @retval	0		Success
+ * @retval	-EINVAL		Size is not a power of two.
+ */
+int poly_queue_init(struct poly_queue_t* const queue,
+		struct poly_qevt_t* const buffer, uint32_t size);
+
+/*!
+ * Queue a control event.  Producer side.
+ * @param	queue		Queue to push to.
+ * @param	when		Sample clock time to apply the event at.
+ *				Events are applied in the order pushed, so
+ *				this should not go backwards.
+ * @param	event		Event to queue; not TIME or END.
+ * @retval	0		Success
+ * @retval	-EINVAL		TIME or END event.
+ * @retval	-EAGAIN		Queue full; try again later.
+ */
+int poly_queue_push(struct poly_queue_t* const queue, uint64_t when,
+		const struct poly_evt_t* const event);
+
+/*!
+ * Read the sample clock: the number of samples rendered through the
+ * queue.  The producer stamps events some margin ahead of this.
+ */
+uint64_t poly_queue_clock(struct poly_queue_t* const queue);
+
+/*!
+ * Count the events waiting in the queue.  A level that stays high
+ * means the producer is scheduling too far ahead.
+ */
+uint32_t poly_queue_level(struct poly_queue_t* const queue);
+
+/*!
+ * Render samples as poly_render does, applying queued events with
+ * poly_load_live at the sample they are stamped with.  Rendering
+ * stops at the end of the current segment, as for poly_render; events
+ * falling after that wait for the next call.  Events that arrive
+ * after their time are applied before the next sample.  Consumer
+ * side: this must be the only thread driving the synthesizer.
+ * @param	queue		Queue to drain.
+ * @param	buffer		Buffer to write the first frame to.
+ * @param	count		Maximum number of frames to write.
+ * @param	out		Output descriptor.
+ * @returns	Number of frames written, or -EINVAL if the descriptor
+ *		is not valid.
+ */
+int poly_queue_render(struct poly_queue_t* const queue, void* buffer,
+		uint16_t count, struct poly_out_t* const out);
+
+/*!
+ * Read the queue statistics.  May be called from any thread.
+ */
+void poly_queue_stats(struct poly_queue_t* const queue,
+		struct poly_queue_stats_t* const stats);
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
+
+#endif
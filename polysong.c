@@ -0,0 +1,206 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers: song files.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+
+#include "polysong.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*!
+ * Check that an array of the given size lies inside the mapping and is
+ * aligned for its elements.
+ */
+static int poly_song_check(const struct poly_song_t* const song,
+		uint32_t offset, uint32_t count, size_t size, size_t align) {
+	if (offset % align)
+		return 0;
+	if (offset > song->map_sz)
+		return 0;
+	return count <= ((song->map_sz - offset) / size);
+}
+
+/*!
+ * Open a song file.
+ */
+int poly_song_open(struct poly_song_t* const song, const char* path) {
+	const struct poly_song_hdr_t* hdr;
+	struct stat st;
+	int res = 0;
+	int fd;
+
+	memset(song, 0, sizeof(*song));
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		res = -errno;
+		goto out;
+	}
+	if ((size_t)st.st_size < sizeof(struct poly_song_hdr_t)) {
+		res = -EINVAL;
+		goto out;
+	}
+
+	song->map_sz = st.st_size;
+	song->map = mmap(NULL, song->map_sz, PROT_READ, MAP_SHARED, fd, 0);
+	if (song->map == MAP_FAILED) {
+		res = -errno;
+		song->map = NULL;
+		goto out;
+	}
+
+	hdr = (const struct poly_song_hdr_t*)song->map;
+	if (hdr->magic != POLY_SONG_MAGIC)
+		res = -EINVAL;
+	else if (hdr->version != POLY_SONG_VERSION)
+		res = -ENOTSUP;
+	else if (!poly_song_check(song, hdr->events, hdr->num_events,
+				sizeof(struct poly_evt_t),
+				_Alignof(struct poly_evt_t)))
+		res = -ERANGE;
+	else if (hdr->num_index && !poly_song_check(song, hdr->index,
+				hdr->num_index,
+				sizeof(struct poly_song_index_t),
+				_Alignof(struct poly_song_index_t)))
+		res = -ERANGE;
+	if (res < 0) {
+		poly_song_close(song);
+		goto out;
+	}
+
+	song->hdr = hdr;
+	song->events = (const struct poly_evt_t*)
+		((const uint8_t*)song->map + hdr->events);
+	if (hdr->num_index)
+		song->index = (const struct poly_song_index_t*)
+			((const uint8_t*)song->map + hdr->index);
+	posix_madvise(song->map, song->map_sz, POSIX_MADV_SEQUENTIAL);
+
+out:
+	close(fd);
+	return res;
+}
+
+/*!
+ * Close a song.
+ */
+void poly_song_close(struct poly_song_t* const song) {
+	if (song->map)
+		munmap(song->map, song->map_sz);
+	memset(song, 0, sizeof(*song));
+}
+
+/*!
+ * Find the index entry for the segment playing at a given sample.
+ */
+const struct poly_song_index_t* poly_song_find(
+		const struct poly_song_t* const song, uint32_t sample) {
+	uint32_t lo = 0, hi;
+
+	if (!song->index || (sample >= song->hdr->length))
+		return NULL;
+
+	/* Last entry starting at or before the sample */
+	hi = song->hdr->num_index;
+	while (lo < hi) {
+		const uint32_t mid = lo + ((hi - lo) / 2);
+		if (song->index[mid].sample <= sample)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo ? &song->index[lo - 1] : NULL;
+}
+
+/*!
+ * Write an event array as a song file.
+ */
+int poly_song_write(const char* path, uint8_t num_channels, uint16_t freq,
+		const struct poly_evt_t* const events, uint32_t num_events,
+		int index) {
+	struct poly_song_hdr_t hdr;
+	struct poly_song_index_t entry;
+	uint64_t length = 0;
+	uint32_t evt;
+	int res = 0;
+	FILE* out;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = POLY_SONG_MAGIC;
+	hdr.version = POLY_SONG_VERSION;
+	hdr.num_channels = num_channels;
+	hdr.freq = freq;
+	hdr.num_events = num_events;
+	hdr.events = sizeof(hdr);
+
+	for (evt = 0; evt < num_events; evt++) {
+		if ((events[evt].flags & POLY_EVT_TYPE_MASK)
+				!= POLY_EVT_TYPE_TIME)
+			continue;
+		length += events[evt].value;
+		hdr.num_index++;
+	}
+	if (length > UINT32_MAX)
+		return -ERANGE;
+	hdr.length = length;
+	if (index && hdr.num_index)
+		hdr.index = hdr.events
+			+ (sizeof(struct poly_evt_t) * num_events);
+	else
+		hdr.num_index = 0;
+
+	out = fopen(path, "wb");
+	if (!out)
+		return -errno;
+	if ((fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+			|| (fwrite(events, sizeof(struct poly_evt_t),
+					num_events, out) != num_events)) {
+		res = -EIO;
+		goto out;
+	}
+
+	length = 0;
+	for (evt = 0; hdr.num_index && (evt < num_events); evt++) {
+		if ((events[evt].flags & POLY_EVT_TYPE_MASK)
+				!= POLY_EVT_TYPE_TIME)
+			continue;
+		entry.event = evt;
+		entry.sample = length;
+		length += events[evt].value;
+		if (fwrite(&entry, sizeof(entry), 1, out) != 1) {
+			res = -EIO;
+			goto out;
+		}
+	}
+
+out:
+	if ((fclose(out) != 0) && !res)
+		res = -EIO;
+	return res;
+}
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
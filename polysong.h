@@ -0,0 +1,129 @@
+#ifndef _POLYSONG_H
+#define _POLYSONG_H
+
+/*!
+ * Polyphonic synthesizer for microcontrollers: song files.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+#include "poly.h"
+#include <stddef.h>
+
+/*! Song file magic number, "PSNG" */
+#define POLY_SONG_MAGIC		(0x474e5350)
+/*! Song file format version */
+#define POLY_SONG_VERSION	(1)
+
+/*!
+ * Song file header.  A song file is this header, followed by the event
+ * array and then the optional index, each at the byte offset given
+ * here.  Everything is stored in the host's byte order and layout, so
+ * the events can be played straight from a mapping of the file; a file
+ * written on a host of the other byte order fails the magic number
+ * check.
+ */
+struct poly_song_hdr_t {
+	uint32_t	magic;		/*!< POLY_SONG_MAGIC */
+	uint16_t	version;	/*!< POLY_SONG_VERSION */
+	uint8_t		num_channels;	/*!< Channels the song is written for */
+	uint8_t		reserved;	/*!< Zero */
+	uint16_t	freq;		/*!< Sample rate the song is written for */
+	uint16_t	reserved2;	/*!< Zero */
+	uint32_t	num_events;	/*!< Number of events */
+	uint32_t	events;		/*!< Offset of the events */
+	uint32_t	num_index;	/*!< Number of index entries, or 0 */
+	uint32_t	index;		/*!< Offset of the index, or 0 */
+	uint32_t	length;		/*!< Length of the song in samples */
+};
+
+/*!
+ * Song index entry: one for each TIME event, giving the sample at which
+ * its segment starts.  The events before a TIME event set up the
+ * segment it plays, so a poly_scan keyframe taken at an entry's event,
+ * then poly_skip, will seek anywhere in the song.
+ */
+struct poly_song_index_t {
+	uint32_t	event;		/*!< Index of the TIME event */
+	uint32_t	sample;		/*!< Sample its segment starts at */
+};
+
+/*!
+ * An open song.  The pointers refer into a read-only shared mapping of
+ * the file, so songs opened by several processes share the page cache.
+ */
+struct poly_song_t {
+	const struct poly_song_hdr_t*	hdr;	/*!< File header */
+	const struct poly_evt_t*	events;	/*!< Events */
+	const struct poly_song_index_t*	index;	/*!< Index, or NULL */
+	void*				map;	/*!< Mapping */
+	size_t				map_sz;	/*!< Size of the mapping */
+};
+
+/*!
+ * Open a song file.  The file is mapped and its header checked, but
+ * the events are not read, so this takes the same time for any length
+ * of song.  Events are checked as they are loaded, as for any other
+ * event array.
+ * @param	song		Receives the open song.
+ * @param	path		File to open.
+ * @retval	0		Success
+ * @retval	-EINVAL		Not a song file, or one written on a host
+ *				of the other byte order.
+ * @retval	-ENOTSUP	Unsupported format version.
+ * @retval	-ERANGE		Events or index lie outside the file.
+ * @returns	Other negative errno values from open, fstat or mmap.
+ */
+int poly_song_open(struct poly_song_t* const song, const char* path);
+
+/*!
+ * Close a song, unmapping it.
+ */
+void poly_song_close(struct poly_song_t* const song);
+
+/*!
+ * Find the index entry for the segment playing at a given sample.
+ * @param	song		Song to search.
+ * @param	sample		Sample to look for.
+ * @returns	Index entry, or NULL if the song has no index or the
+ *		sample is before the first segment or past the end.
+ */
+const struct poly_song_index_t* poly_song_find(
+		const struct poly_song_t* const song, uint32_t sample);
+
+/*!
+ * Write an event array as a song file.
+ * @param	path		File to write.
+ * @param	num_channels	Channels the song is written for.
+ * @param	freq		Sample rate the song is written for.
+ * @param	events		Events to write.
+ * @param	num_events	Number of events.
+ * @param	index		Non-zero to include an index.
+ * @retval	0		Success
+ * @retval	-ERANGE		Song longer than 2^32 samples.
+ * @retval	-EIO		Write failed.
+ * @returns	Other negative errno values from fopen.
+ */
+int poly_song_write(const char* path, uint8_t num_channels, uint16_t freq,
+		const struct poly_evt_t* const events, uint32_t num_events,
+		int index);
+
+/*
+ * vim: set sw=8 ts=8 noet si tw=72
+ */
+
+#endif
@@ -0,0 +1,247 @@
+/*!
+ * Polyphonic synthesizer for microcontrollers: trace decoder.
+ * (C) 2016 Stuart Longland
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/*
+ * Reads a dump of a struct poly_trace_ring_t, from a debugger or from
+ * pctest -t, and prints its records oldest first, with the full sample
+ * clock.  The dump is decoded byte by byte, so the decoder does not
+ * need to be built with the same _POLY_TRACE_SZ as the firmware.
+ *
+ * Usage: polytrace [-f FREQ] DUMP
+ * With -f, times are also shown in seconds.
+ */
+
+#include "poly.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*! Size of the ring header and of each record in a dump */
+#define HEADER_SZ	(12)
+#define RECORD_SZ	(6)
+
+/*! Event type names, indexed by type number */
+static const char* const event_names[16] = {
+	"END", "TIME", "ENABLE", "MUTE", "IFREQ", "DFREQ", "PMOD", "PRIO",
+	"IAMP", "DAMP", "AMOD", "ASCALE", "WAVE", "RATE", "PCM", "DSCALE",
+};
+
+static uint16_t get16(const uint8_t* p) {
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t* p) {
+	return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+/*!
+ * Print an event record's type and channel.
+ */
+static void print_event_type(uint8_t arg) {
+	const uint8_t type = arg >> (POLY_EVT_TYPE_BIT - 8);
+	switch (type << POLY_EVT_TYPE_BIT) {
+		case POLY_EVT_TYPE_END:
+		case POLY_EVT_TYPE_TIME:
+		case POLY_EVT_TYPE_ENABLE:
+		case POLY_EVT_TYPE_MUTE:
+			printf("%s", event_names[type]);
+			break;
+		default:
+			printf("ch %u %s", arg & 0x0f, event_names[type]);
+	}
+}
+
+/*!
+ * Print an event record's type, channel and value.
+ */
+static void print_event(uint8_t arg, uint16_t value) {
+	const uint8_t type = arg >> (POLY_EVT_TYPE_BIT - 8);
+	const uint8_t ch = arg & 0x0f;
+
+	switch (type << POLY_EVT_TYPE_BIT) {
+		case POLY_EVT_TYPE_END:
+		case POLY_EVT_TYPE_TIME:
+			printf("%s %u", event_names[type], value);
+			break;
+		case POLY_EVT_TYPE_ENABLE:
+		case POLY_EVT_TYPE_MUTE:
+			printf("%s 0x%04x", event_names[type], value);
+			break;
+		case POLY_EVT_TYPE_DFREQ:
+			printf("ch %u %s %d", ch, event_names[type],
+					(int16_t)value);
+			break;
+		case POLY_EVT_TYPE_DAMP:
+			printf("ch %u %s %d", ch, event_names[type],
+					(int8_t)value);
+			break;
+		default:
+			printf("ch %u %s %u", ch, event_names[type], value);
+	}
+}
+
+/*!
+ * Print FIFO event flags, FIFO_EVT_* in fifo.h.
+ */
+static void print_fifo(uint8_t events) {
+	static const char* const names[] = {
+		"EMPTY", "UNDERRUN", "NEW", "FULL", "OVERRUN", "LOW",
+	};
+	uint8_t bit;
+	for (bit = 0; bit < (sizeof(names) / sizeof(names[0])); bit++)
+		if (events & (1 << bit))
+			printf("%s ", names[bit]);
+}
+
+/*!
+ * Print one record.
+ */
+static void print_record(uint64_t time, uint32_t freq, uint8_t type,
+		uint8_t arg, uint16_t value) {
+	printf("%12llu ", (unsigned long long)time);
+	if (freq)
+		printf("%12.6f ", (double)time / freq);
+
+	switch (type) {
+		case POLY_TRACE_WRAP:
+			printf("wrap    clock %llu\n",
+					(unsigned long long)time);
+			break;
+		case POLY_TRACE_EVENT:
+			printf("event   ");
+			print_event(arg, value);
+			printf("\n");
+			break;
+		case POLY_TRACE_REJECT:
+			printf("reject  ");
+			print_event_type(arg);
+			printf(": %s\n", strerror(value));
+			break;
+		case POLY_TRACE_FREQ:
+			printf("freq    ch %u -> %u\n", arg, value);
+			break;
+		case POLY_TRACE_AMP:
+			printf("amp     ch %u -> %u\n", arg, value);
+			break;
+		case POLY_TRACE_CLAMP:
+			printf("clamp   ch %u %s at %u\n",
+					arg & ~POLY_TRACE_CLAMP_AMP,
+					(arg & POLY_TRACE_CLAMP_AMP)
+					? "amp" : "freq", value);
+			break;
+		case POLY_TRACE_CLIP:
+			printf("clip    ch %u %d\n", arg, (int16_t)value);
+			break;
+		case POLY_TRACE_FIFO:
+			printf("fifo    ");
+			print_fifo(arg);
+			printf("level %u\n", value);
+			break;
+		case POLY_TRACE_BLOCK:
+			printf("block   fifo %u", arg);
+			if (value)
+				printf(", %u us", value);
+			printf("\n");
+			break;
+		default:
+			printf("type %-3u arg 0x%02x value 0x%04x\n",
+					type, arg, value);
+	}
+}
+
+int main(int argc, char** argv) {
+	uint8_t header[HEADER_SZ];
+	uint8_t* records;
+	uint32_t freq = 0;
+	uint32_t clock, head, count, first, rec;
+	uint16_t size;
+	uint64_t* times;
+	uint64_t now;
+	FILE* dump;
+
+	if ((argc > 2) && !strcmp(argv[1], "-f")) {
+		freq = atoi(argv[2]);
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc != 2) {
+		fprintf(stderr, "Usage: polytrace [-f FREQ] DUMP\n");
+		return 1;
+	}
+
+	dump = fopen(argv[1], "rb");
+	if (!dump) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(header, HEADER_SZ, 1, dump) != 1) {
+		fprintf(stderr, "%s: short header\n", argv[1]);
+		return 1;
+	}
+	clock = get32(header);
+	head = get32(header + 4);
+	size = get16(header + 10);
+	if (!size || (size & (size - 1))) {
+		fprintf(stderr, "%s: bad ring size %u\n", argv[1], size);
+		return 1;
+	}
+
+	records = malloc((size_t)size * RECORD_SZ);
+	times = calloc(size, sizeof(uint64_t));
+	if (!records || !times) {
+		perror("malloc");
+		return 1;
+	}
+	if (fread(records, RECORD_SZ, size, dump) != size) {
+		fprintf(stderr, "%s: short dump\n", argv[1]);
+		return 1;
+	}
+	fclose(dump);
+
+	count = (head < size) ? head : size;
+	first = head - count;
+	if (head > size)
+		printf("# %u records lost to wrap-around\n", head - size);
+
+	/*
+	 * Recover the full clock of each record working back from the
+	 * newest.  Records are never more than 65536 samples apart, as
+	 * the clock wrapping is itself recorded.
+	 */
+	now = clock;
+	for (rec = count; rec--; ) {
+		const uint8_t* r = &records[((first + rec) & (size - 1))
+			* RECORD_SZ];
+		uint64_t time = (now & ~(uint64_t)UINT16_MAX) | get16(r);
+		if (time > now)
+			time -= (UINT16_MAX + 1);
+		times[rec] = now = time;
+	}
+
+	for (rec = 0; rec < count; rec++) {
+		const uint8_t* r = &records[((first + rec) & (size - 1))
+			* RECORD_SZ];
+		print_record(times[rec], freq, r[2], r[3], get16(r + 4));
+	}
+
+	free(records);
+	free(times);
+	return 0;
+}